@@ -9,7 +9,7 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
-    | CELL  # Cell
+    | (CELL | SHEET_CELL)  # Cell
     | NUMBER  # Literal
     ;
 
@@ -27,4 +27,6 @@ SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
 CELL: [A-Z]+[0-9]+ ;
+// a cell of another sheet of the workbook: Sheet2!A1
+SHEET_CELL: [A-Za-z_] [A-Za-z0-9_]* '!' [A-Z]+ [0-9]+ ;
 WS: [ \t\n\r]+ -> skip ;
@@ -3,12 +3,19 @@
 #include "FormulaBaseListener.h"
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
+#include "formula.h"
+#include "memory.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <iterator>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace ASTImpl
 {
@@ -71,13 +78,24 @@ namespace ASTImpl
         /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
     };
 
+    // where the copy of an AST finds the copies of its cell references
+    struct CellMapping
+    {
+        std::unordered_map<const Position*, const Position*> cells;
+        std::unordered_map<const SheetReference*, const SheetReference*> sheet_cells;
+    };
+
     class Expr
     {
     public:
         virtual ~Expr() = default;
+        virtual std::unique_ptr<Expr> Clone(const CellMapping& cells) const = 0;
         virtual void Print(std::ostream& out) const = 0;
         virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-        virtual double Evaluate(const SheetInterface& sheet) const = 0;
+        virtual double Evaluate(const CellValueSource& source) const = 0;
+        virtual bool Compile(FormulaProgram& program) const = 0;
+        // Bytes of the node and of everything below it
+        virtual std::size_t GetMemoryUsage() const = 0;
 
         // higher is tighter
         virtual ExprPrecedence GetPrecedence() const = 0;
@@ -99,7 +117,11 @@ namespace ASTImpl
 
     namespace
     {
-        class BinaryOpExpr final : public Expr
+        // A left-to-right chain of binary operations of one precedence family:
+        // a+b-c+d is one node with the operands a, b, c, d rather than a tree
+        // as deep as the chain is long. It evaluates, prints and is destroyed
+        // with loops, and folds exactly as the nested operations would.
+        class ChainExpr final : public Expr
         {
         public:
             enum Type : char
@@ -111,24 +133,147 @@ namespace ASTImpl
             };
 
         public:
-            explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs) : type(type), lhs(std::move(lhs)), rhs(std::move(rhs)) { }
+            explicit ChainExpr(std::unique_ptr<Expr> first, Type type, std::unique_ptr<Expr> operand)
+            {
+                operands.push_back(std::move(first));
+                Append(type, std::move(operand));
+            }
+
+            // Whether `this type operand` can continue the chain
+            bool Continues(Type type) const
+            {
+                return IsAdditive(type) == IsAdditive(types.front());
+            }
+            void Append(Type type, std::unique_ptr<Expr> operand)
+            {
+                types.push_back(type);
+                operands.push_back(std::move(operand));
+            }
+
+            std::unique_ptr<Expr> Clone(const CellMapping& cells) const override
+            {
+                auto copy = std::make_unique<ChainExpr>(operands[0]->Clone(cells), types[0], operands[1]->Clone(cells));
+                for (std::size_t i = 1; i < types.size(); ++i)
+                {
+                    copy->Append(types[i], operands[i + 1]->Clone(cells));
+                }
+
+                return copy;
+            }
 
             void Print(std::ostream& out) const override
             {
-                out << '(' << static_cast<char>(type) << ' ';
-                lhs->Print(out);
-                out << ' ';
-                rhs->Print(out);
-                out << ')';
+                // the same nested form the binary operations would print
+                for (auto it = types.rbegin(); it != types.rend(); ++it)
+                {
+                    out << '(' << static_cast<char>(*it) << ' ';
+                }
+                operands[0]->Print(out);
+                for (std::size_t i = 1; i < operands.size(); ++i)
+                {
+                    out << ' ';
+                    operands[i]->Print(out);
+                    out << ')';
+                }
             }
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override
             {
-                lhs->PrintFormula(out, precedence);
-                out << static_cast<char>(type);
-                rhs->PrintFormula(out, precedence, /* right_child = */ true);
+                // every operation is the left child of the next one, which never needs parentheses
+                operands[0]->PrintFormula(out, GetPrecedence(types[0]));
+                for (std::size_t i = 0; i < types.size(); ++i)
+                {
+                    out << static_cast<char>(types[i]);
+                    operands[i + 1]->PrintFormula(out, GetPrecedence(types[i]), /* right_child = */ true);
+                }
             }
 
+            // of the last operation, which is the outermost one
             ExprPrecedence GetPrecedence() const override
+            {
+                return GetPrecedence(types.back());
+            }
+
+            double Evaluate(const CellValueSource& source) const override
+            {
+                double result = operands[0]->Evaluate(source);
+
+                for (std::size_t i = 0; i < types.size(); ++i)
+                {
+                    double rhs_value = operands[i + 1]->Evaluate(source);
+
+                    switch (types[i])
+                    {
+                    case Type::Add:
+                        result = result + rhs_value;
+                        break;
+                    case Type::Subtract:
+                        result = result - rhs_value;
+                        break;
+                    case Type::Multiply:
+                        result = result * rhs_value;
+                        break;
+                    case Type::Divide:
+                        if (rhs_value < std::numeric_limits<double>::epsilon() && rhs_value > -std::numeric_limits<double>::epsilon())
+                            throw FormulaError(FormulaError::Category::Div0);
+                        // a quotient is not checked for overflow
+                        result = result / rhs_value;
+                        continue;
+                    }
+
+                    if (result == std::numeric_limits<double>::infinity() || result == -std::numeric_limits<double>::infinity())
+                        throw FormulaError(FormulaError::Category::Div0);
+                }
+
+                return result;
+            }
+
+            bool Compile(FormulaProgram& program) const override
+            {
+                if (!operands[0]->Compile(program))
+                    return false;
+
+                for (std::size_t i = 0; i < types.size(); ++i)
+                {
+                    if (!operands[i + 1]->Compile(program))
+                        return false;
+
+                    switch (types[i])
+                    {
+                    case Type::Add:
+                        program.code.push_back(FormulaProgram::Op::Add);
+                        break;
+                    case Type::Subtract:
+                        program.code.push_back(FormulaProgram::Op::Subtract);
+                        break;
+                    case Type::Multiply:
+                        program.code.push_back(FormulaProgram::Op::Multiply);
+                        break;
+                    case Type::Divide:
+                        program.code.push_back(FormulaProgram::Op::Divide);
+                        break;
+                    }
+                }
+
+                return true;
+            }
+
+            std::size_t GetMemoryUsage() const override
+            {
+                std::size_t result = sizeof(*this) + Memory::Heap(types) + Memory::Heap(operands);
+                for (const std::unique_ptr<Expr>& operand : operands)
+                {
+                    result += operand->GetMemoryUsage();
+                }
+
+                return result;
+            }
+
+        private:
+            static bool IsAdditive(Type type)
+            {
+                return type == Add || type == Subtract;
+            }
+            static ExprPrecedence GetPrecedence(Type type)
             {
                 switch (type)
                 {
@@ -147,40 +292,8 @@ namespace ASTImpl
                 }
             }
 
-            double Evaluate(const SheetInterface& sheet) const override
-            {
-                double result = 0;
-                double lhs_value = lhs->Evaluate(sheet);
-                double rhs_value = rhs->Evaluate(sheet);
-
-                switch (type)
-                {
-                case Type::Add:
-                    result = lhs_value + rhs_value;
-                    break;
-                case Type::Subtract:
-                    result = lhs_value - rhs_value;
-                    break;
-                case Type::Multiply:
-                    result = lhs_value * rhs_value;
-                    break;
-                case Type::Divide:
-                    if (rhs_value < std::numeric_limits<double>::epsilon() && rhs_value > -std::numeric_limits<double>::epsilon())
-                        throw FormulaError(FormulaError::Category::Div0);
-                    else
-                        return lhs_value / rhs_value;
-                }
-
-                if (result == std::numeric_limits<double>::infinity() || result == -std::numeric_limits<double>::infinity())
-                    throw FormulaError(FormulaError::Category::Div0);
-                else
-                    return result;
-            }
-
-        private:
-            Type type;
-            std::unique_ptr<Expr> lhs;
-            std::unique_ptr<Expr> rhs;
+            std::vector<Type> types;  // types[i] joins operands[i + 1] to everything before it
+            std::vector<std::unique_ptr<Expr>> operands;
         };
         class UnaryOpExpr final : public Expr
         {
@@ -194,6 +307,11 @@ namespace ASTImpl
         public:
             explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)  : type(type), operand(std::move(operand)) { }
 
+            std::unique_ptr<Expr> Clone(const CellMapping& cells) const override
+            {
+                return std::make_unique<UnaryOpExpr>(type, operand->Clone(cells));
+            }
+
             void Print(std::ostream& out) const override
             {
                 out << '(' << static_cast<char>(type) << ' ';
@@ -211,9 +329,9 @@ namespace ASTImpl
                 return EP_UNARY;
             }
 
-            double Evaluate(const SheetInterface& sheet) const override
+            double Evaluate(const CellValueSource& source) const override
             {
-                double value = operand->Evaluate(sheet);
+                double value = operand->Evaluate(source);
 
                 switch (type)
                 {
@@ -224,15 +342,51 @@ namespace ASTImpl
                 }
             }
 
+            bool Compile(FormulaProgram& program) const override
+            {
+                if (!operand->Compile(program))
+                    return false;
+
+                if (type == Type::UnaryMinus)
+                    program.code.push_back(FormulaProgram::Op::Negate);
+
+                return true;
+            }
+
+            std::size_t GetMemoryUsage() const override
+            {
+                return sizeof(*this) + operand->GetMemoryUsage();
+            }
+
         private:
             Type type;
             std::unique_ptr<Expr> operand;
         };
+        double ToNumber(const CellInterface::Value& value)
+        {
+            if (std::holds_alternative<std::string>(value))
+            {
+                if (std::get<std::string>(value) == "")
+                    return 0.0;
+                else
+                    throw FormulaError(FormulaError::Category::Value);
+            }
+            else if (std::holds_alternative<FormulaError>(value))
+                throw std::get<FormulaError>(value);
+            else
+                return std::get<double>(value);
+        }
+
         class CellExpr final : public Expr
         {
         public:
             explicit CellExpr(const Position* cell) : cell(cell) { }
 
+            std::unique_ptr<Expr> Clone(const CellMapping& cells) const override
+            {
+                return std::make_unique<CellExpr>(cells.cells.at(cell));
+            }
+
             void Print(std::ostream& out) const override
             {
                 if (!cell->IsValid())
@@ -249,36 +403,83 @@ namespace ASTImpl
                 return EP_ATOM;
             }
 
-            double Evaluate(const SheetInterface& sheet) const override
+            double Evaluate(const CellValueSource& source) const override
             {
-                const CellInterface* c = sheet.GetCell(*cell);
+                return ToNumber(source.GetCellValue(*cell));
+            }
 
-                if (!c)
-                    return 0.0;
+            bool Compile(FormulaProgram& program) const override
+            {
+                if (!cell->IsValid())
+                    return false;
 
-                CellInterface::Value result = c->GetValue();
+                program.code.push_back(FormulaProgram::Op::Load);
+                program.loads.push_back(*cell);
+                return true;
+            }
 
-                if (std::holds_alternative<std::string>(result))
-                {
-                    if (std::get<std::string>(result) == "")
-                        return 0.0;
-                    else
-                        throw FormulaError(FormulaError::Category::Value);
-                }
-                else if (std::holds_alternative<FormulaError>(result))
-                    throw std::get<FormulaError>(result);
-                else
-                    return std::get<double>(result);
+            std::size_t GetMemoryUsage() const override
+            {
+                return sizeof(*this);
             }
 
         private:
             const Position* cell;
         };
+        class SheetCellExpr final : public Expr
+        {
+        public:
+            explicit SheetCellExpr(const SheetReference* ref) : ref(ref) { }
+
+            std::unique_ptr<Expr> Clone(const CellMapping& cells) const override
+            {
+                return std::make_unique<SheetCellExpr>(cells.sheet_cells.at(ref));
+            }
+
+            void Print(std::ostream& out) const override
+            {
+                if (!ref->pos.IsValid())
+                    out << FormulaError::Category::Ref;
+                else
+                    out << ref->ToString();
+            }
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override
+            {
+                Print(out);
+            }
+            ExprPrecedence GetPrecedence() const override
+            {
+                return EP_ATOM;
+            }
+
+            double Evaluate(const CellValueSource& source) const override
+            {
+                return ToNumber(source.GetSheetCellValue(*ref));
+            }
+
+            bool Compile(FormulaProgram&) const override
+            {
+                return false;
+            }
+
+            std::size_t GetMemoryUsage() const override
+            {
+                return sizeof(*this);
+            }
+
+        private:
+            const SheetReference* ref;
+        };
         class NumberExpr final : public Expr
         {
         public:
             explicit NumberExpr(double value) : value(value) { }
 
+            std::unique_ptr<Expr> Clone(const CellMapping&) const override
+            {
+                return std::make_unique<NumberExpr>(value);
+            }
+
             void Print(std::ostream& out) const override
             {
                 out << value;
@@ -293,11 +494,23 @@ namespace ASTImpl
                 return EP_ATOM;
             }
 
-            double Evaluate(const SheetInterface&) const override
+            double Evaluate(const CellValueSource&) const override
             {
                 return value;
             }
 
+            bool Compile(FormulaProgram& program) const override
+            {
+                program.code.push_back(FormulaProgram::Op::Number);
+                program.numbers.push_back(value);
+                return true;
+            }
+
+            std::size_t GetMemoryUsage() const override
+            {
+                return sizeof(*this);
+            }
+
         private:
             double value;
         };
@@ -318,6 +531,10 @@ namespace ASTImpl
             {
                 return std::move(cells);
             }
+            std::forward_list<SheetReference> MoveSheetCells()
+            {
+                return std::move(sheet_cells);
+            }
 
         public:
             void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override
@@ -353,6 +570,19 @@ namespace ASTImpl
             }
             void exitCell(FormulaParser::CellContext* ctx) override
             {
+                if (ctx->SHEET_CELL())
+                {
+                    auto ref_str = ctx->SHEET_CELL()->getSymbol()->getText();
+                    auto bang = ref_str.find('!');
+                    SheetReference ref{ref_str.substr(0, bang), Position::FromString(std::string_view(ref_str).substr(bang + 1))};
+                    if (!ref.pos.IsValid())
+                        throw FormulaException("Invalid position: " + ref_str);
+
+                    sheet_cells.push_front(std::move(ref));
+                    args.push_back(std::make_unique<SheetCellExpr>(&sheet_cells.front()));
+                    return;
+                }
+
                 auto value_str = ctx->CELL()->getSymbol()->getText();
                 auto value = Position::FromString(value_str);
                 if (!value.IsValid())
@@ -371,20 +601,28 @@ namespace ASTImpl
 
                 auto lhs = std::move(args.back());
 
-                BinaryOpExpr::Type type;
+                ChainExpr::Type type;
                 if (ctx->ADD())
-                    type = BinaryOpExpr::Add;
+                    type = ChainExpr::Add;
                 else if (ctx->SUB())
-                    type = BinaryOpExpr::Subtract;
+                    type = ChainExpr::Subtract;
                 else if (ctx->MUL())
-                    type = BinaryOpExpr::Multiply;
+                    type = ChainExpr::Multiply;
                 else
                 {
                     assert(ctx->DIV() != nullptr);
-                    type = BinaryOpExpr::Divide;
+                    type = ChainExpr::Divide;
                 }
 
-                auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+                // a+b+c arrives as (a+b)+c: extend the chain of the left operand
+                if (auto* chain = dynamic_cast<ChainExpr*>(lhs.get()); chain && chain->Continues(type))
+                {
+                    chain->Append(type, std::move(rhs));
+                    args.back() = std::move(lhs);
+                    return;
+                }
+
+                auto node = std::make_unique<ChainExpr>(std::move(lhs), type, std::move(rhs));
                 args.back() = std::move(node);
             }
 
@@ -396,6 +634,7 @@ namespace ASTImpl
         private:
             std::vector<std::unique_ptr<Expr>> args;
             std::forward_list<Position> cells;
+            std::forward_list<SheetReference> sheet_cells;
         };
 
         class BailErrorListener : public antlr4::BaseErrorListener
@@ -411,35 +650,126 @@ namespace ASTImpl
     }
 }
 
-FormulaAST ParseFormulaAST(std::istream& in)
+namespace
 {
-    using namespace antlr4;
+    // A chain of binary operators is parsed by a loop, walked iteratively and
+    // flattened into one ChainExpr, so it may be as long as it likes. The
+    // parser and the AST still recurse once per parenthesis and unary
+    // operator; past this a formula would run out of stack instead
+    constexpr int MAX_NESTING = 256;
+
+    // Measures the nesting on the text, before the parser gets to recurse.
+    // The signs of exponents count as unary operators, which only makes the
+    // bound stricter.
+    void CheckNesting(std::string_view text)
+    {
+        int depth = 0;
+        std::vector<int> opened;  // the depth inside each open parenthesis
+        bool operand_expected = true;
+
+        for (char c : text)
+        {
+            switch (c)
+            {
+            case ' ': case '\t': case '\n': case '\r':
+                continue;
+            case '(':
+                opened.push_back(++depth);
+                operand_expected = true;
+                break;
+            case ')':
+                if (!opened.empty())
+                    opened.pop_back();
+                // the operand is complete, and so are the unary operators before it
+                depth = opened.empty() ? 0 : opened.back();
+                operand_expected = false;
+                break;
+            case '+': case '-':
+                if (operand_expected)
+                    ++depth;
+                operand_expected = true;
+                break;
+            case '*': case '/':
+                operand_expected = true;
+                break;
+            default:
+                if (operand_expected)
+                    depth = opened.empty() ? 0 : opened.back();
+                operand_expected = false;
+                break;
+            }
+
+            if (depth > MAX_NESTING)
+                throw FormulaException("Formula is nested deeper than " + std::to_string(MAX_NESTING) + " levels");
+        }
+    }
+
+    // The lexer, the parser and their streams are built once per thread and
+    // reset for every formula. The parser owns the parse tree nodes and frees
+    // them all at once on reset.
+    class ParseContext
+    {
+    public:
+        ParseContext() : lexer(&input), tokens(&lexer), parser(&tokens)
+        {
+            lexer.removeErrorListeners();
+            lexer.addErrorListener(&error_listener);
 
-    ANTLRInputStream input(in);
+            parser.setErrorHandler(std::make_shared<antlr4::BailErrorStrategy>());
+            parser.removeErrorListeners();
+        }
 
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
+        FormulaAST Parse(std::string_view text)
+        {
+            using namespace antlr4;
 
-    CommonTokenStream tokens(&lexer);
+            // the trees and tokens of this formula go away even if it fails to parse
+            struct Release
+            {
+                ParseContext& context;
+                ~Release()
+                {
+                    context.tokens.setTokenSource(&context.lexer);
+                    context.parser.reset();
+                }
+            } release{*this};
+
+            input.load(text.data(), text.size(), false);
+            lexer.setInputStream(&input);
+            tokens.setTokenSource(&lexer);
+            parser.setTokenStream(&tokens);
+
+            tree::ParseTree* tree = parser.main();
+            ASTImpl::ParseASTListener listener;
+            // the walk goes as deep as the parse tree, which is as long as the
+            // longest chain of binary operators
+            tree::IterativeParseTreeWalker walker;
+            walker.walk(&listener, tree);
 
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
+            return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveSheetCells());
+        }
 
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
+    private:
+        antlr4::ANTLRInputStream input;
+        FormulaLexer lexer;
+        ASTImpl::BailErrorListener error_listener;
+        antlr4::CommonTokenStream tokens;
+        FormulaParser parser;
+    };
+}
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+FormulaAST ParseFormulaAST(std::istream& in)
+{
+    std::string text(std::istreambuf_iterator<char>(in), {});
+    return ParseFormulaAST(std::string_view(text));
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str)
+FormulaAST ParseFormulaAST(std::string_view in_str)
 {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+    CheckNesting(in_str);
+
+    thread_local ParseContext context;
+    return context.Parse(in_str);
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const
@@ -460,14 +790,93 @@ void FormulaAST::PrintFormula(std::ostream& out) const
     root_expr->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
-double FormulaAST::Execute(const SheetInterface& sheet) const
+double FormulaAST::Execute(const CellValueSource& source) const
 {
-    return root_expr->Evaluate(sheet);
+    return root_expr->Evaluate(source);
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells) : root_expr(std::move(root_expr)) , cells(std::move(cells))
+bool FormulaAST::Compile(FormulaProgram& program) const
 {
-    cells.sort();  // to avoid sorting in GetReferencedCells
+    if (!root_expr->Compile(program))
+        return false;
+
+    int depth = 0;
+    for (FormulaProgram::Op op : program.code)
+    {
+        if (op == FormulaProgram::Op::Load || op == FormulaProgram::Op::Number)
+            program.depth = std::max(program.depth, ++depth);
+        else if (op != FormulaProgram::Op::Negate)
+            --depth;
+    }
+
+    return true;
+}
+
+std::size_t FormulaAST::GetMemoryUsage() const
+{
+    std::size_t result = root_expr->GetMemoryUsage();
+    result += std::distance(cells.begin(), cells.end()) * Memory::ListNode<Position>();
+    for (const SheetReference& ref : sheet_cells)
+    {
+        result += Memory::ListNode<SheetReference>() + Memory::Heap(ref.sheet);
+    }
+
+    return result;
 }
 
+FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells, std::forward_list<SheetReference> sheet_cells) : root_expr(std::move(root_expr)) , cells(std::move(cells)), sheet_cells(std::move(sheet_cells))
+{
+    this->cells.sort();  // CellExpr nodes keep pointing at the same elements
+}
+
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
+
+FormulaAST FormulaAST::Clone() const
+{
+    std::forward_list<Position> cells_copy(cells);
+    std::forward_list<SheetReference> sheet_cells_copy(sheet_cells);
+    ASTImpl::CellMapping mapping;
+
+    auto copy = cells_copy.cbegin();
+    for (auto it = cells.cbegin(); it != cells.cend(); ++it, ++copy)
+    {
+        mapping.cells.emplace(&*it, &*copy);
+    }
+    auto sheet_copy = sheet_cells_copy.cbegin();
+    for (auto it = sheet_cells.cbegin(); it != sheet_cells.cend(); ++it, ++sheet_copy)
+    {
+        mapping.sheet_cells.emplace(&*it, &*sheet_copy);
+    }
+
+    return FormulaAST(root_expr->Clone(mapping), std::move(cells_copy), std::move(sheet_cells_copy));
+}
+
+bool FormulaAST::RemapCells(const std::function<Position(Position)>& remap)
+{
+    bool changed = false;
+
+    // every CellExpr points into `cells`, so the tree follows without being touched
+    for (Position& pos : cells)
+    {
+        Position moved = remap(pos);
+        changed |= !(moved == pos);
+        pos = moved;
+    }
+
+    return changed;
+}
+bool FormulaAST::RemapSheetCells(const std::function<Position(Position)>& remap)
+{
+    bool changed = false;
+
+    for (SheetReference& ref : sheet_cells)
+    {
+        Position moved = remap(ref.pos);
+        changed |= !(moved == ref.pos);
+        ref.pos = moved;
+    }
+
+    return changed;
+}
@@ -6,12 +6,15 @@
 #include <forward_list>
 #include <functional>
 #include <stdexcept>
+#include <string_view>
 
 namespace ASTImpl
 {
     class Expr;
 }
 
+struct FormulaProgram;
+
 class ParsingError : public std::runtime_error
 {
     using std::runtime_error::runtime_error;
@@ -20,15 +23,26 @@ class ParsingError : public std::runtime_error
 class FormulaAST
 {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,std::forward_list<Position> cells, std::forward_list<SheetReference> sheet_cells = {});
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
-    double Execute(const SheetInterface& sheet) const;
+    // Deep copy that shares nothing with this tree
+    FormulaAST Clone() const;
+    // Rewrites the referenced positions in place; returns whether any changed
+    bool RemapCells(const std::function<Position(Position)>& remap);
+    // The same for the positions of references to other sheets
+    bool RemapSheetCells(const std::function<Position(Position)>& remap);
+
+    double Execute(const CellValueSource& source) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
+    // Appends the postfix form of the tree; false if it reads other sheets or has #REF!
+    bool Compile(FormulaProgram& program) const;
+    // Heap bytes of the tree and the reference lists, without the object itself
+    std::size_t GetMemoryUsage() const;
 
     std::forward_list<Position>& GetCells()
     {
@@ -38,11 +52,16 @@ public:
     {
         return cells;
     }
+    const std::forward_list<SheetReference>& GetSheetCells() const
+    {
+        return sheet_cells;
+    }
 
 private:
     std::unique_ptr<ASTImpl::Expr> root_expr;
     std::forward_list<Position> cells;
+    std::forward_list<SheetReference> sheet_cells;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+FormulaAST ParseFormulaAST(std::string_view in_str);
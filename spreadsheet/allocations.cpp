@@ -0,0 +1,166 @@
+#include "allocations.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+namespace Allocations
+{
+    namespace
+    {
+        // plain data, so bumping them from operator new never allocates
+        thread_local Counts thread_counts;
+        thread_local Scope* current_scope = nullptr;
+
+        std::atomic<std::uint64_t> total_allocations{0};
+        std::atomic<std::uint64_t> total_bytes{0};
+
+        std::atomic<Site*> sites{nullptr};
+
+        [[maybe_unused]] void Count(std::size_t size)
+        {
+            ++thread_counts.allocations;
+            thread_counts.bytes += size;
+            total_allocations.fetch_add(1, std::memory_order_relaxed);
+            total_bytes.fetch_add(size, std::memory_order_relaxed);
+        }
+
+        Counts operator-(Counts lhs, Counts rhs)
+        {
+            return {lhs.allocations - rhs.allocations, lhs.bytes - rhs.bytes};
+        }
+    }
+
+    Site::Site(const char* name) : name(name)
+    {
+        next = sites.load(std::memory_order_relaxed);
+        while (!sites.compare_exchange_weak(next, this, std::memory_order_release, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    Scope::Scope(Site& site) : site(site), start(thread_counts), parent(current_scope)
+    {
+        current_scope = this;
+    }
+    Scope::~Scope()
+    {
+        Counts total = thread_counts - start;
+        Counts self = total - nested;
+
+        site.calls.fetch_add(1, std::memory_order_relaxed);
+        site.allocations.fetch_add(total.allocations, std::memory_order_relaxed);
+        site.bytes.fetch_add(total.bytes, std::memory_order_relaxed);
+        site.self_allocations.fetch_add(self.allocations, std::memory_order_relaxed);
+        site.self_bytes.fetch_add(self.bytes, std::memory_order_relaxed);
+
+        if (parent)
+        {
+            parent->nested.allocations += total.allocations;
+            parent->nested.bytes += total.bytes;
+        }
+        current_scope = parent;
+    }
+
+    bool IsEnabled()
+    {
+#ifdef SPREADSHEET_ALLOCATION_TRACKING
+        return true;
+#else
+        return false;
+#endif
+    }
+    Counts GetThreadCounts()
+    {
+        return thread_counts;
+    }
+    Counts GetTotalCounts()
+    {
+        return {total_allocations.load(std::memory_order_relaxed), total_bytes.load(std::memory_order_relaxed)};
+    }
+
+    std::vector<SiteStats> Collect()
+    {
+        std::vector<SiteStats> result;
+        for (const Site* site = sites.load(std::memory_order_acquire); site; site = site->next)
+        {
+            std::uint64_t calls = site->calls.load(std::memory_order_relaxed);
+            if (calls == 0)
+                continue;
+
+            result.push_back({site->name, calls,
+                              {site->allocations.load(std::memory_order_relaxed), site->bytes.load(std::memory_order_relaxed)},
+                              {site->self_allocations.load(std::memory_order_relaxed), site->self_bytes.load(std::memory_order_relaxed)}});
+        }
+
+        std::sort(result.begin(), result.end(), [](const SiteStats& lhs, const SiteStats& rhs) { return lhs.self.allocations > rhs.self.allocations; });
+        return result;
+    }
+    void Reset()
+    {
+        for (Site* site = sites.load(std::memory_order_acquire); site; site = site->next)
+        {
+            site->calls.store(0, std::memory_order_relaxed);
+            site->allocations.store(0, std::memory_order_relaxed);
+            site->bytes.store(0, std::memory_order_relaxed);
+            site->self_allocations.store(0, std::memory_order_relaxed);
+            site->self_bytes.store(0, std::memory_order_relaxed);
+        }
+    }
+    void WriteReport(std::ostream& output, const std::vector<SiteStats>& sites)
+    {
+        output << "site\tcalls\tallocations\tbytes\tself_allocations\tself_bytes\n";
+
+        for (const SiteStats& site : sites)
+        {
+            output << site.name << '\t' << site.calls << '\t' << site.total.allocations << '\t' << site.total.bytes << '\t'
+                   << site.self.allocations << '\t' << site.self.bytes << '\n';
+        }
+    }
+}
+
+#ifdef SPREADSHEET_ALLOCATION_TRACKING
+
+// The array and nothrow forms of the standard library call these. GCC cannot
+// tell that free() is the matching release for this operator new.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(std::size_t size)
+{
+    Allocations::Count(size);
+
+    if (void* ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    Allocations::Count(size);
+
+    std::size_t align = static_cast<std::size_t>(alignment);
+    if (void* ptr = std::aligned_alloc(align, (std::max<std::size_t>(size, 1) + align - 1) / align * align))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept
+{
+    std::free(ptr);
+}
+
+#endif
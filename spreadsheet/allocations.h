@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Opt-in heap allocation tracking, built with SPREADSHEET_ALLOCATION_TRACKING.
+// The global operator new is replaced to count the allocations and bytes of
+// every thread, and call sites marked with SPREADSHEET_ALLOCATION_SCOPE collect
+// what the calls through them allocated: in all, and outside the marked sites
+// they called ("self"). Without the option nothing is counted, the counts stay
+// zero and the macro compiles to nothing.
+namespace Allocations
+{
+    struct Counts
+    {
+        std::uint64_t allocations = 0;
+        std::uint64_t bytes = 0;
+    };
+
+    struct SiteStats
+    {
+        std::string name;
+        std::uint64_t calls = 0;
+        Counts total;
+        Counts self;
+    };
+
+    class Site
+    {
+    public:
+        // Registered for the lifetime of the program
+        explicit Site(const char* name);
+
+    private:
+        friend class Scope;
+        friend std::vector<SiteStats> Collect();
+        friend void Reset();
+
+        const char* name;
+        std::atomic<std::uint64_t> calls{0};
+        std::atomic<std::uint64_t> allocations{0};
+        std::atomic<std::uint64_t> bytes{0};
+        std::atomic<std::uint64_t> self_allocations{0};
+        std::atomic<std::uint64_t> self_bytes{0};
+        Site* next = nullptr;
+    };
+
+    // Charges the allocations of the calling thread to the site while it lives
+    class Scope
+    {
+    public:
+        explicit Scope(Site& site);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        Site& site;
+        Counts start;
+        Counts nested;  // made inside the scopes opened within this one
+        Scope* parent;
+    };
+
+    bool IsEnabled();
+    // Made by the calling thread since it started
+    Counts GetThreadCounts();
+    // Made by all threads
+    Counts GetTotalCounts();
+
+    // Every site called at least once, the most self allocations first
+    std::vector<SiteStats> Collect();
+    void Reset();
+    void WriteReport(std::ostream& output, const std::vector<SiteStats>& sites);
+
+    // What the calling thread allocates while it lives; see ASSERT_ALLOCATIONS in the tests
+    class Measurement
+    {
+    public:
+        Measurement() : start(GetThreadCounts()) {}
+
+        Counts Get() const
+        {
+            Counts now = GetThreadCounts();
+            return {now.allocations - start.allocations, now.bytes - start.bytes};
+        }
+
+    private:
+        Counts start;
+    };
+}
+
+#ifdef SPREADSHEET_ALLOCATION_TRACKING
+#define SPREADSHEET_ALLOCATION_SCOPE(name)                      \
+    static ::Allocations::Site allocation_site_at_call(name);   \
+    ::Allocations::Scope allocation_scope_at_call(allocation_site_at_call)
+#else
+#define SPREADSHEET_ALLOCATION_SCOPE(name) ((void)0)
+#endif
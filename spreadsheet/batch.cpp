@@ -0,0 +1,487 @@
+#include "batch.h"
+
+#include "cell.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <limits>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SPREADSHEET_BATCH_SSE2
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define SPREADSHEET_BATCH_AVX2
+#endif
+
+namespace
+{
+    using Op = FormulaProgram::Op;
+
+    // lanes gathered and computed at once
+    const std::size_t SLICE = 256;
+
+    const double INF = std::numeric_limits<double>::infinity();
+    const double EPSILON = std::numeric_limits<double>::epsilon();
+
+    // The same checks as BinaryOpExpr::Evaluate
+    bool IsZeroDivisor(double rhs)
+    {
+        return rhs < EPSILON && rhs > -EPSILON;
+    }
+    bool IsOverflow(double result)
+    {
+        return result == INF || result == -INF;
+    }
+
+    // A binary kernel computes `out = lhs op rhs` lane by lane (out may be
+    // lhs) and returns whether any lane failed; the caller then finds which
+    struct Kernels
+    {
+        bool (*binary)(Op op, const double* lhs, const double* rhs, double* out, std::size_t count);
+        void (*negate)(double* values, std::size_t count);
+    };
+
+    template <Op op>
+    bool ScalarLoop(const double* lhs, const double* rhs, double* out, std::size_t count)
+    {
+        bool failed = false;
+
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            if constexpr (op == Op::Add)
+                out[i] = lhs[i] + rhs[i];
+            else if constexpr (op == Op::Subtract)
+                out[i] = lhs[i] - rhs[i];
+            else if constexpr (op == Op::Multiply)
+                out[i] = lhs[i] * rhs[i];
+
+            if constexpr (op == Op::Divide)
+            {
+                failed |= IsZeroDivisor(rhs[i]);
+                out[i] = lhs[i] / rhs[i];
+            }
+            else
+                failed |= IsOverflow(out[i]);
+        }
+
+        return failed;
+    }
+    bool ScalarBinary(Op op, const double* lhs, const double* rhs, double* out, std::size_t count)
+    {
+        switch (op)
+        {
+        case Op::Add:
+            return ScalarLoop<Op::Add>(lhs, rhs, out, count);
+        case Op::Subtract:
+            return ScalarLoop<Op::Subtract>(lhs, rhs, out, count);
+        case Op::Multiply:
+            return ScalarLoop<Op::Multiply>(lhs, rhs, out, count);
+        default:
+            return ScalarLoop<Op::Divide>(lhs, rhs, out, count);
+        }
+    }
+    void ScalarNegate(double* values, std::size_t count)
+    {
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            values[i] = -values[i];
+        }
+    }
+
+#ifdef SPREADSHEET_BATCH_SSE2
+    template <Op op>
+    bool Sse2Loop(const double* lhs, const double* rhs, double* out, std::size_t count)
+    {
+        const __m128d abs_mask = _mm_castsi128_pd(_mm_set1_epi64x(0x7fffffffffffffff));
+        const __m128d inf = _mm_set1_pd(INF);
+        const __m128d epsilon = _mm_set1_pd(EPSILON);
+        __m128d failed = _mm_setzero_pd();
+
+        std::size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+        {
+            __m128d a = _mm_loadu_pd(lhs + i);
+            __m128d b = _mm_loadu_pd(rhs + i);
+            __m128d result;
+
+            if constexpr (op == Op::Add)
+                result = _mm_add_pd(a, b);
+            else if constexpr (op == Op::Subtract)
+                result = _mm_sub_pd(a, b);
+            else if constexpr (op == Op::Multiply)
+                result = _mm_mul_pd(a, b);
+            else
+                result = _mm_div_pd(a, b);
+
+            if constexpr (op == Op::Divide)
+                failed = _mm_or_pd(failed, _mm_cmplt_pd(_mm_and_pd(b, abs_mask), epsilon));
+            else
+                failed = _mm_or_pd(failed, _mm_cmpeq_pd(_mm_and_pd(result, abs_mask), inf));
+
+            _mm_storeu_pd(out + i, result);
+        }
+
+        bool tail = ScalarLoop<op>(lhs + i, rhs + i, out + i, count - i);
+        return _mm_movemask_pd(failed) != 0 || tail;
+    }
+    bool Sse2Binary(Op op, const double* lhs, const double* rhs, double* out, std::size_t count)
+    {
+        switch (op)
+        {
+        case Op::Add:
+            return Sse2Loop<Op::Add>(lhs, rhs, out, count);
+        case Op::Subtract:
+            return Sse2Loop<Op::Subtract>(lhs, rhs, out, count);
+        case Op::Multiply:
+            return Sse2Loop<Op::Multiply>(lhs, rhs, out, count);
+        default:
+            return Sse2Loop<Op::Divide>(lhs, rhs, out, count);
+        }
+    }
+    void Sse2Negate(double* values, std::size_t count)
+    {
+        const __m128d sign = _mm_set1_pd(-0.0);
+
+        std::size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+        {
+            _mm_storeu_pd(values + i, _mm_xor_pd(_mm_loadu_pd(values + i), sign));
+        }
+        ScalarNegate(values + i, count - i);
+    }
+#endif
+
+#ifdef SPREADSHEET_BATCH_AVX2
+    template <Op op>
+    __attribute__((target("avx2"))) bool Avx2Loop(const double* lhs, const double* rhs, double* out, std::size_t count)
+    {
+        const __m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffff));
+        const __m256d inf = _mm256_set1_pd(INF);
+        const __m256d epsilon = _mm256_set1_pd(EPSILON);
+        __m256d failed = _mm256_setzero_pd();
+
+        std::size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            __m256d a = _mm256_loadu_pd(lhs + i);
+            __m256d b = _mm256_loadu_pd(rhs + i);
+            __m256d result;
+
+            if constexpr (op == Op::Add)
+                result = _mm256_add_pd(a, b);
+            else if constexpr (op == Op::Subtract)
+                result = _mm256_sub_pd(a, b);
+            else if constexpr (op == Op::Multiply)
+                result = _mm256_mul_pd(a, b);
+            else
+                result = _mm256_div_pd(a, b);
+
+            if constexpr (op == Op::Divide)
+                failed = _mm256_or_pd(failed, _mm256_cmp_pd(_mm256_and_pd(b, abs_mask), epsilon, _CMP_LT_OQ));
+            else
+                failed = _mm256_or_pd(failed, _mm256_cmp_pd(_mm256_and_pd(result, abs_mask), inf, _CMP_EQ_OQ));
+
+            _mm256_storeu_pd(out + i, result);
+        }
+
+        bool tail = ScalarLoop<op>(lhs + i, rhs + i, out + i, count - i);
+        return _mm256_movemask_pd(failed) != 0 || tail;
+    }
+    bool Avx2Binary(Op op, const double* lhs, const double* rhs, double* out, std::size_t count)
+    {
+        switch (op)
+        {
+        case Op::Add:
+            return Avx2Loop<Op::Add>(lhs, rhs, out, count);
+        case Op::Subtract:
+            return Avx2Loop<Op::Subtract>(lhs, rhs, out, count);
+        case Op::Multiply:
+            return Avx2Loop<Op::Multiply>(lhs, rhs, out, count);
+        default:
+            return Avx2Loop<Op::Divide>(lhs, rhs, out, count);
+        }
+    }
+    __attribute__((target("avx2"))) void Avx2Negate(double* values, std::size_t count)
+    {
+        const __m256d sign = _mm256_set1_pd(-0.0);
+
+        std::size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            _mm256_storeu_pd(values + i, _mm256_xor_pd(_mm256_loadu_pd(values + i), sign));
+        }
+        ScalarNegate(values + i, count - i);
+    }
+#endif
+
+    Kernels GetKernels(BatchEvaluator::InstructionSet set)
+    {
+        switch (set)
+        {
+#ifdef SPREADSHEET_BATCH_AVX2
+        case BatchEvaluator::InstructionSet::AVX2:
+            return {Avx2Binary, Avx2Negate};
+#endif
+#ifdef SPREADSHEET_BATCH_SSE2
+        case BatchEvaluator::InstructionSet::SSE2:
+            return {Sse2Binary, Sse2Negate};
+#endif
+        default:
+            return {ScalarBinary, ScalarNegate};
+        }
+    }
+}
+
+BatchEvaluator::InstructionSet BatchEvaluator::GetBestInstructionSet()
+{
+#ifdef SPREADSHEET_BATCH_AVX2
+    // may run during static initialization, before the runtime has looked at the processor
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return InstructionSet::AVX2;
+#endif
+#ifdef SPREADSHEET_BATCH_SSE2
+    return InstructionSet::SSE2;
+#else
+    return InstructionSet::Scalar;
+#endif
+}
+
+namespace
+{
+    std::atomic<BatchEvaluator::InstructionSet> instruction_set{BatchEvaluator::GetBestInstructionSet()};
+}
+
+BatchEvaluator::InstructionSet BatchEvaluator::GetInstructionSet()
+{
+    return instruction_set.load(std::memory_order_relaxed);
+}
+void BatchEvaluator::SetInstructionSet(InstructionSet set)
+{
+    instruction_set.store(std::min(set, GetBestInstructionSet()), std::memory_order_relaxed);
+}
+
+BatchEvaluator::BatchEvaluator(const CellStorage::Index& index, const CellValueSource& source, InstructionSet set) : index(index), source(source), set(std::min(set, GetBestInstructionSet())) {}
+
+std::size_t BatchEvaluator::Run()
+{
+    FindBatches();
+
+    state.assign(batches.size(), 0);
+    for (std::size_t i = 0; i < batches.size(); ++i)
+    {
+        Evaluate(i);
+    }
+
+    std::size_t evaluated = 0;
+    for (const Batch& batch : batches)
+    {
+        evaluated += batch.cells.size();
+    }
+    SPREADSHEET_METRIC_ADD(BatchedEvaluations, evaluated);
+
+    return evaluated;
+}
+
+void BatchEvaluator::FindBatches()
+{
+    struct Candidate
+    {
+        int row;
+        const Cell* cell;
+        const FormulaProgram* program;
+    };
+
+    // blocks come in row-major order, so every column comes out sorted by row
+    std::map<int, std::vector<Candidate>> columns;
+    for (const auto& [key, block] : index)
+    {
+        for (int slot = 0; slot < CellStorage::BLOCK_SIZE * CellStorage::BLOCK_SIZE; ++slot)
+        {
+            const Cell* cell = block->cells[slot].get();
+            if (!cell)
+                continue;
+
+            const FormulaInterface* formula = cell->GetFormula();
+            const FormulaProgram* program = formula ? formula->GetProgram() : nullptr;
+            if (!program || cell->GetCashedValue())
+                continue;
+
+            int row = key.row * CellStorage::BLOCK_SIZE + slot / CellStorage::BLOCK_SIZE;
+            int col = key.col * CellStorage::BLOCK_SIZE + slot % CellStorage::BLOCK_SIZE;
+            columns[col].push_back({row, cell, program});
+        }
+    }
+
+    for (const auto& [col, candidates] : columns)
+    {
+        std::size_t begin = 0;
+        while (begin < candidates.size())
+        {
+            std::size_t end = begin + 1;
+            while (end < candidates.size() && candidates[end].row == candidates[end - 1].row + 1
+                   && candidates[end - 1].program->IsShiftedBy(*candidates[end].program, 1))
+            {
+                ++end;
+            }
+
+            const Candidate& first = candidates[begin];
+            int count = int(end - begin);
+
+            // a run that reads its own cells has to go one cell after another
+            bool reads_itself = std::any_of(first.program->loads.begin(), first.program->loads.end(), [&first, col = col, count](const Position& load)
+            {
+                return load.col == col && load.row < first.row + count && first.row < load.row + count;
+            });
+
+            if (count >= MIN_RUN && !reads_itself)
+            {
+                Batch batch{{first.row, col}, {}, first.program};
+                for (std::size_t i = begin; i < end; ++i)
+                {
+                    batch.cells.push_back(candidates[i].cell);
+                }
+
+                batches_by_column[col].push_back(batches.size());
+                batches.push_back(std::move(batch));
+            }
+
+            begin = end;
+        }
+    }
+}
+
+void BatchEvaluator::Evaluate(std::size_t i)
+{
+    if (state[i] != 0)
+        return;
+    state[i] = 1;
+
+    const Batch& batch = batches[i];
+    int count = int(batch.cells.size());
+
+    for (const Position& load : batch.program->loads)
+    {
+        auto it = batches_by_column.find(load.col);
+        if (it == batches_by_column.end())
+            continue;
+
+        for (std::size_t other : it->second)
+        {
+            const Batch& source_batch = batches[other];
+            if (load.row < source_batch.first.row + int(source_batch.cells.size()) && source_batch.first.row < load.row + count)
+                Evaluate(other);
+        }
+    }
+
+    for (std::size_t first = 0; first < batch.cells.size(); first += SLICE)
+    {
+        Compute(batch, first, std::min(SLICE, batch.cells.size() - first));
+    }
+
+    state[i] = 2;
+}
+
+void BatchEvaluator::Compute(const Batch& batch, std::size_t first, std::size_t count)
+{
+    const FormulaProgram& program = *batch.program;
+    Kernels kernels = GetKernels(set);
+
+    inputs.resize(program.loads.size() * SLICE);
+    input_errors.resize(program.loads.size());
+    stack.resize(std::max(program.depth, 1) * SLICE);
+    errors.assign(count, std::nullopt);
+    column.resize(SLICE);
+
+    // gathering evaluates whatever the inputs need the usual way
+    for (std::size_t k = 0; k < program.loads.size(); ++k)
+    {
+        const Position& load = program.loads[k];
+        CellStorage::GetColumn(index, {load.row + int(first), load.col}, int(count), column.data());
+
+        double* values = &inputs[k * SLICE];
+        input_errors[k].clear();
+
+        for (std::size_t lane = 0; lane < count; ++lane)
+        {
+            if (!column[lane])
+            {
+                values[lane] = 0.0;
+                continue;
+            }
+
+            // the conversions of ToNumber in FormulaAST.cpp
+            CellInterface::Value value = column[lane]->GetValue(source);
+            if (std::holds_alternative<double>(value))
+                values[lane] = std::get<double>(value);
+            else if (std::holds_alternative<FormulaError>(value))
+                input_errors[k].emplace_back(lane, std::get<FormulaError>(value));
+            else if (std::get<std::string>(value).empty())
+                values[lane] = 0.0;
+            else
+                input_errors[k].emplace_back(lane, FormulaError(FormulaError::Category::Value));
+        }
+    }
+
+    // the program runs in the order a single evaluation would, so the first
+    // error a lane meets is the one its evaluation would throw
+    auto fail = [this](std::size_t lane, FormulaError error)
+    {
+        if (!errors[lane])
+            errors[lane] = error;
+    };
+
+    std::size_t top = 0;
+    std::size_t next_load = 0;
+    std::size_t next_number = 0;
+    for (Op op : program.code)
+    {
+        switch (op)
+        {
+        case Op::Load:
+            std::memcpy(&stack[top * SLICE], &inputs[next_load * SLICE], count * sizeof(double));
+            for (const auto& [lane, error] : input_errors[next_load])
+            {
+                fail(lane, error);
+            }
+            ++next_load;
+            ++top;
+            break;
+        case Op::Number:
+            std::fill_n(&stack[top * SLICE], count, program.numbers[next_number++]);
+            ++top;
+            break;
+        case Op::Negate:
+            kernels.negate(&stack[(top - 1) * SLICE], count);
+            break;
+        default:
+        {
+            double* lhs = &stack[(top - 2) * SLICE];
+            const double* rhs = &stack[(top - 1) * SLICE];
+
+            if (kernels.binary(op, lhs, rhs, lhs, count))
+            {
+                for (std::size_t lane = 0; lane < count; ++lane)
+                {
+                    if (op == Op::Divide ? IsZeroDivisor(rhs[lane]) : IsOverflow(lhs[lane]))
+                        fail(lane, FormulaError(FormulaError::Category::Div0));
+                }
+            }
+            --top;
+            break;
+        }
+        }
+    }
+
+    for (std::size_t lane = 0; lane < count; ++lane)
+    {
+        if (errors[lane])
+            batch.cells[first + lane]->FillCash(*errors[lane]);
+        else
+            batch.cells[first + lane]->FillCash(stack[lane]);
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+#include "storage.h"
+
+#include <cstddef>
+#include <map>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// Evaluates runs of vertically adjacent formula cells of one shape
+// (=B2*C2-D2, =B3*C3-D3, ...) a column slice at a time. The inputs of a run
+// are gathered into arrays, and every operation of the shared program runs
+// over the whole slice with SIMD instructions picked at run time. Each cell
+// gets exactly the value, or the first error, its own evaluation would give.
+// Only empty cashes are filled; whatever is not batched is left to the usual
+// evaluation, and batched cells do not show up in the evaluation profile.
+class BatchEvaluator
+{
+public:
+    enum class InstructionSet
+    {
+        Scalar,
+        SSE2,
+        AVX2,
+    };
+
+    // Shorter runs are not worth gathering
+    static const int MIN_RUN = 8;
+
+    // The widest set this build and processor support
+    static InstructionSet GetBestInstructionSet();
+    // The set recalculation uses, the best one unless set otherwise; a set
+    // the processor lacks is replaced with the best one it has
+    static InstructionSet GetInstructionSet();
+    static void SetInstructionSet(InstructionSet set);
+
+    BatchEvaluator(const CellStorage::Index& index, const CellValueSource& source, InstructionSet set = GetInstructionSet());
+
+    // Returns the number of cells evaluated
+    std::size_t Run();
+
+private:
+    struct Batch
+    {
+        Position first;
+        std::vector<const Cell*> cells;
+        const FormulaProgram* program;
+    };
+
+    void FindBatches();
+    // Evaluates the batches it reads from first, so their values are gathered from the cash
+    void Evaluate(std::size_t batch);
+    void Compute(const Batch& batch, std::size_t first, std::size_t count);
+
+    const CellStorage::Index& index;
+    const CellValueSource& source;
+    InstructionSet set;
+
+    std::vector<Batch> batches;
+    std::map<int, std::vector<std::size_t>> batches_by_column;
+    std::vector<char> state;  // of every batch: 0 waiting, 1 evaluating, 2 done
+
+    // reused by every slice
+    std::vector<double> inputs;
+    std::vector<std::vector<std::pair<std::size_t, FormulaError>>> input_errors;
+    std::vector<double> stack;
+    std::vector<std::optional<FormulaError>> errors;
+    std::vector<const Cell*> column;
+};
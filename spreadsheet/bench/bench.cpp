@@ -0,0 +1,467 @@
+// Self-contained micro benchmarks for the spreadsheet core.
+// Usage: spreadsheet_bench [name filter]; prints a JSON report to stdout.
+
+#include "allocations.h"
+#include "common.h"
+#include "formula.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+// An allocation tracking build counts every allocation already
+#ifndef SPREADSHEET_ALLOCATION_TRACKING
+
+namespace
+{
+    std::atomic<std::uint64_t> allocation_count{0};
+    std::atomic<std::uint64_t> allocation_bytes{0};
+}
+
+// counting replacements of the global allocation functions; GCC cannot tell
+// that free() is the matching release for this operator new
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(std::size_t size)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    allocation_bytes.fetch_add(size, std::memory_order_relaxed);
+
+    if (void* ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+namespace
+{
+    Allocations::Counts GetAllocations()
+    {
+        return {allocation_count.load(), allocation_bytes.load()};
+    }
+}
+
+#else
+
+namespace
+{
+    Allocations::Counts GetAllocations()
+    {
+        return Allocations::GetTotalCounts();
+    }
+}
+
+#endif
+
+namespace
+{
+    long PeakRssKb()
+    {
+#if defined(__unix__) || defined(__APPLE__)
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+#else
+        return 0;
+#endif
+    }
+
+    std::string Ref(int row, int col)
+    {
+        return Position{row, col}.ToString();
+    }
+
+    struct Result
+    {
+        std::string name;
+        std::uint64_t ops = 0;
+        double ns_per_op = 0;
+        double allocs_per_op = 0;
+        double bytes_per_op = 0;
+        long peak_rss_kb = 0;
+    };
+
+    class BenchRunner
+    {
+    public:
+        explicit BenchRunner(std::string filter) : filter(std::move(filter)) {}
+
+        // setup runs untimed; body does `ops` operations and is timed as a whole
+        void Run(const std::string& name, std::uint64_t ops, const std::function<void()>& setup, const std::function<void()>& body)
+        {
+            if (name.find(filter) == std::string::npos)
+                return;
+
+            setup();
+
+            Allocations::Counts allocations = GetAllocations();
+            auto start = std::chrono::steady_clock::now();
+
+            body();
+
+            auto elapsed = std::chrono::steady_clock::now() - start;
+
+            Result result;
+            result.name = name;
+            result.ops = ops;
+            result.ns_per_op = std::chrono::duration<double, std::nano>(elapsed).count() / ops;
+            result.allocs_per_op = double(GetAllocations().allocations - allocations.allocations) / ops;
+            result.bytes_per_op = double(GetAllocations().bytes - allocations.bytes) / ops;
+            result.peak_rss_kb = PeakRssKb();
+            results.push_back(result);
+        }
+
+        void PrintJson(std::ostream& out) const
+        {
+            out << "{\n  \"benchmarks\": [";
+            for (size_t i = 0; i < results.size(); ++i)
+            {
+                const Result& r = results[i];
+                out << (i ? "," : "") << "\n    {\"name\": \"" << r.name << "\", \"ops\": " << r.ops
+                    << ", \"ns_per_op\": " << r.ns_per_op << ", \"allocs_per_op\": " << r.allocs_per_op
+                    << ", \"bytes_per_op\": " << r.bytes_per_op << ", \"peak_rss_kb\": " << r.peak_rss_kb << "}";
+            }
+            out << "\n  ]\n}\n";
+        }
+
+    private:
+        std::string filter;
+        std::vector<Result> results;
+    };
+
+    void BenchChains(BenchRunner& runner)
+    {
+        const int depth = 2000;
+        std::unique_ptr<Sheet> sheet;
+
+        auto build = [&]
+        {
+            sheet->SetCell(Position{0, 0}, "1");
+            for (int i = 1; i < depth; ++i)
+            {
+                sheet->SetCell(Position{i, 0}, "=" + Ref(i - 1, 0) + "+1");
+            }
+        };
+
+        runner.Run("chain/build", depth, [&] { sheet = std::make_unique<Sheet>(); }, build);
+
+        const int edits = 50;
+        runner.Run("chain/edit_root_read_leaf", edits, [&] { sheet = std::make_unique<Sheet>(); build(); }, [&]
+        {
+            for (int i = 0; i < edits; ++i)
+            {
+                sheet->SetCell(Position{0, 0}, std::to_string(i + 2));
+                sheet->GetCell(Position{depth - 1, 0})->GetValue();
+            }
+        });
+    }
+
+    void BenchFans(BenchRunner& runner)
+    {
+        const int width = 5000;
+        std::unique_ptr<Sheet> sheet;
+
+        auto build_fan_out = [&]
+        {
+            sheet = std::make_unique<Sheet>();
+            sheet->SetCell(Position{0, 0}, "1");
+            for (int i = 1; i <= width; ++i)
+            {
+                sheet->SetCell(Position{i, 1}, "=A1*2");
+            }
+        };
+
+        const int edits = 20;
+        runner.Run("fan_out/edit_root_read_all", edits * width, build_fan_out, [&]
+        {
+            for (int i = 0; i < edits; ++i)
+            {
+                sheet->SetCell(Position{0, 0}, std::to_string(i + 2));
+                for (int j = 1; j <= width; ++j)
+                {
+                    sheet->GetCell(Position{j, 1})->GetValue();
+                }
+            }
+        });
+
+        const int inputs = 500;
+        runner.Run("fan_in/edit_input_read_sum", edits, [&]
+        {
+            sheet = std::make_unique<Sheet>();
+            std::string formula = "=A1";
+            for (int i = 0; i < inputs; ++i)
+            {
+                sheet->SetCell(Position{i, 0}, std::to_string(i));
+                if (i)
+                    formula += "+" + Ref(i, 0);
+            }
+            sheet->SetCell(Position{0, 1}, formula);
+        }, [&]
+        {
+            for (int i = 0; i < edits; ++i)
+            {
+                sheet->SetCell(Position{i, 0}, std::to_string(i + 1000));
+                sheet->GetCell(Position{0, 1})->GetValue();
+            }
+        });
+    }
+
+    void BenchRandomDag(BenchRunner& runner)
+    {
+        const int cells = 3000;
+        const int max_refs = 4;
+        std::unique_ptr<Sheet> sheet;
+        std::vector<std::string> texts;
+
+        auto make_texts = [&]
+        {
+            std::mt19937 random(42);
+            sheet = std::make_unique<Sheet>();
+            texts.clear();
+            for (int i = 0; i < cells; ++i)
+            {
+                if (i < max_refs)
+                {
+                    texts.push_back(std::to_string(i));
+                    continue;
+                }
+                std::string formula = "=1";
+                for (int r = std::uniform_int_distribution<int>(1, max_refs)(random); r > 0; --r)
+                {
+                    int input = std::uniform_int_distribution<int>(0, i - 1)(random);
+                    formula += "+" + Ref(input / 10, input % 10);
+                }
+                texts.push_back(formula);
+            }
+        };
+        auto build = [&]
+        {
+            for (int i = 0; i < cells; ++i)
+            {
+                sheet->SetCell(Position{i / 10, i % 10}, texts[i]);
+            }
+        };
+
+        runner.Run("random_dag/build", cells, make_texts, build);
+        runner.Run("random_dag/evaluate_all", cells, [&] { make_texts(); build(); }, [&]
+        {
+            for (int i = 0; i < cells; ++i)
+            {
+                sheet->GetCell(Position{i / 10, i % 10})->GetValue();
+            }
+        });
+    }
+
+    void BenchBulkSet(BenchRunner& runner)
+    {
+        const int rows = 200;
+        const int cols = 50;
+        std::unique_ptr<Sheet> sheet;
+
+        auto set_literals = [&]
+        {
+            for (int i = 0; i < rows; ++i)
+            {
+                for (int j = 0; j < cols; ++j)
+                {
+                    sheet->SetCell(Position{i, j}, std::to_string(i * cols + j));
+                }
+            }
+        };
+        auto set_formulas = [&]
+        {
+            for (int i = 0; i < rows; ++i)
+            {
+                for (int j = 0; j < cols; ++j)
+                {
+                    sheet->SetCell(Position{i, j + cols}, "=" + Ref(i, j) + "*2+1");
+                }
+            }
+        };
+        auto build = [&]
+        {
+            sheet = std::make_unique<Sheet>();
+            set_literals();
+            set_formulas();
+        };
+
+        runner.Run("bulk_set/literals", rows * cols, [&] { sheet = std::make_unique<Sheet>(); }, set_literals);
+        runner.Run("bulk_set/formulas", rows * cols, [&] { sheet = std::make_unique<Sheet>(); }, set_formulas);
+
+        runner.Run("print/values", rows * cols * 2, build, [&]
+        {
+            std::ostringstream out;
+            sheet->PrintValues(out);
+        });
+        runner.Run("print/texts", rows * cols * 2, build, [&]
+        {
+            std::ostringstream out;
+            sheet->PrintTexts(out);
+        });
+
+        // the same formulas as bulk_set/formulas, parsed once per column and copied down
+        runner.Run("bulk_set/fill_formulas", rows * cols, [&] { sheet = std::make_unique<Sheet>(); }, [&]
+        {
+            for (int j = 0; j < cols; ++j)
+            {
+                sheet->SetCell(Position{0, j + cols}, "=" + Ref(0, j) + "*2+1");
+            }
+            sheet->FillRange(Position{0, cols}, {1, cols}, Position{1, cols}, {rows - 1, cols});
+        });
+    }
+
+    void BenchPositionCodec(BenchRunner& runner)
+    {
+        const int count = 100000;
+        std::vector<Position> positions;
+        std::vector<std::string> names;
+
+        auto make_positions = [&]
+        {
+            std::mt19937 random(7);
+            positions.clear();
+            names.clear();
+            for (int i = 0; i < count; ++i)
+            {
+                positions.push_back({std::uniform_int_distribution<int>(0, Position::MAX_ROWS - 1)(random), std::uniform_int_distribution<int>(0, Position::MAX_COLS - 1)(random)});
+            }
+        };
+        auto make_names = [&]
+        {
+            for (const Position& pos : positions)
+            {
+                names.push_back(pos.ToString());
+            }
+        };
+
+        runner.Run("position/to_string", count, make_positions, make_names);
+        runner.Run("position/from_string", count, [&] { make_positions(); make_names(); }, [&]
+        {
+            int valid = 0;
+            for (const std::string& name : names)
+            {
+                valid += Position::FromString(name).IsValid();
+            }
+            if (valid != count)
+                std::cerr << "position/from_string: round trip mismatch" << std::endl;
+        });
+    }
+
+    void BenchSameShape(BenchRunner& runner)
+    {
+        const int rows = 10000;
+        std::unique_ptr<Sheet> sheet;
+
+        auto build = [&]
+        {
+            sheet = std::make_unique<Sheet>();
+            for (int i = 0; i < rows; ++i)
+            {
+                sheet->SetCell(Position{i, 0}, std::to_string(i % 100 + 1));
+                sheet->SetCell(Position{i, 1}, std::to_string(i % 7 + 2));
+                sheet->SetCell(Position{i, 2}, std::to_string(i % 13));
+                sheet->SetCell(Position{i, 3}, "=" + Ref(i, 0) + "*" + Ref(i, 1) + "-" + Ref(i, 2) + "/4");
+            }
+        };
+
+        // the cells of the formula column one by one, then all of them in batches
+        runner.Run("same_shape/evaluate_cells", rows, build, [&]
+        {
+            for (int i = 0; i < rows; ++i)
+            {
+                sheet->GetCell(Position{i, 3})->GetValue();
+            }
+        });
+        runner.Run("same_shape/recalculate", rows, build, [&] { sheet->Recalculate(); });
+    }
+
+    void BenchParsing(BenchRunner& runner)
+    {
+        const int count = 20000;
+        const unsigned threads = std::max(2u, std::thread::hardware_concurrency());
+        std::vector<std::string> texts;
+
+        auto make_texts = [&]
+        {
+            texts.clear();
+            for (int i = 0; i < count; ++i)
+            {
+                texts.push_back(Ref(i % 1000, i % 50) + "*2+(" + Ref(i % 700, 3) + "-" + std::to_string(i) + ")/4");
+            }
+        };
+
+        runner.Run("parse/sequential", count, make_texts, [&]
+        {
+            for (const std::string& text : texts)
+            {
+                ParseFormula(text);
+            }
+        });
+
+        // every thread parses its own slice with its own parser
+        runner.Run("parse/parallel", count, make_texts, [&]
+        {
+            std::vector<std::thread> workers;
+            for (unsigned t = 0; t < threads; ++t)
+            {
+                workers.emplace_back([&texts, t, threads]
+                {
+                    for (std::size_t i = t; i < texts.size(); i += threads)
+                    {
+                        ParseFormula(texts[i]);
+                    }
+                });
+            }
+            for (std::thread& worker : workers)
+            {
+                worker.join();
+            }
+        });
+    }
+}
+
+int main(int argc, char** argv)
+{
+    BenchRunner runner(argc > 1 ? argv[1] : "");
+
+    BenchChains(runner);
+    BenchFans(runner);
+    BenchRandomDag(runner);
+    BenchBulkSet(runner);
+    BenchPositionCodec(runner);
+    BenchSameShape(runner);
+    BenchParsing(runner);
+
+    runner.PrintJson(std::cout);
+
+    return 0;
+}
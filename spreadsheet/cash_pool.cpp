@@ -0,0 +1,93 @@
+#include "cash_pool.h"
+
+#include "metrics.h"
+
+#include <algorithm>
+
+void CashPool::SetBudget(std::size_t bytes)
+{
+    budget = bytes;
+    trim_above = bytes;
+}
+std::size_t CashPool::GetBudget() const
+{
+    return budget;
+}
+bool CashPool::IsBounded() const
+{
+    return budget != 0;
+}
+
+void CashPool::RecordHit()
+{
+    hits.fetch_add(1, std::memory_order_relaxed);
+}
+void CashPool::RecordFill(std::size_t bytes)
+{
+    misses.fetch_add(1, std::memory_order_relaxed);
+    resident.fetch_add(bytes, std::memory_order_relaxed);
+}
+void CashPool::Release(std::size_t bytes)
+{
+    // cashes a snapshot reader filled were never counted: stay at zero
+    std::size_t current = resident.load(std::memory_order_relaxed);
+    while (!resident.compare_exchange_weak(current, current > bytes ? current - bytes : 0, std::memory_order_relaxed))
+    {
+    }
+}
+void CashPool::Recount(std::size_t bytes)
+{
+    resident.store(bytes, std::memory_order_relaxed);
+}
+
+void CashPool::Trim(const std::set<Position>& positions, const std::function<Visit(Position)>& visit)
+{
+    if (!IsBounded() || GetResidentBytes() <= trim_above)
+        return;
+
+    std::size_t visited = 0;
+    std::size_t kept = 0;
+    auto it = positions.upper_bound(hand);
+
+    while (GetResidentBytes() > budget && visited < 2 * positions.size())
+    {
+        if (it == positions.end())
+            it = positions.begin();
+
+        Visit result = visit(*it);
+        hand = *it++;
+
+        if (result.evicted)
+        {
+            ++evictions;
+            SPREADSHEET_METRIC_ADD(CashEvictions, 1);
+            Release(result.evicted);
+        }
+
+        // the count drifts with cells the sheet dropped without knowing their cash
+        kept += result.kept;
+        if (++visited == positions.size())
+            Recount(kept);
+    }
+
+    // the next sweep waits for the cashes to grow by the slack again, even
+    // if this one had to give up above the budget
+    trim_above = std::max(GetResidentBytes(), budget) + budget / SLACK;
+}
+
+std::size_t CashPool::GetResidentBytes() const
+{
+    return resident.load(std::memory_order_relaxed);
+}
+std::uint64_t CashPool::GetHits() const
+{
+    return hits.load(std::memory_order_relaxed);
+}
+std::uint64_t CashPool::GetMisses() const
+{
+    return misses.load(std::memory_order_relaxed);
+}
+std::uint64_t CashPool::GetEvictions() const
+{
+    return evictions;
+}
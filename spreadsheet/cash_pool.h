@@ -0,0 +1,63 @@
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <set>
+
+// Bounded mode of the cashes of one sheet. The values stay in the cells; the
+// pool counts the bytes of the ones the sheet computed and, once they pass the
+// budget, sweeps the positions like a CLOCK hand: a cell read since the hand
+// last passed gets a second chance, any other one gives up its cash and is
+// computed again on its next read. Without a budget only the size is counted.
+class CashPool
+{
+public:
+    // What the hand found at one position
+    struct Visit
+    {
+        std::size_t kept = 0;     // bytes still cashed there
+        std::size_t evicted = 0;  // bytes the visit released
+    };
+
+    // Zero (the default) lets the cashes grow with the sheet
+    void SetBudget(std::size_t bytes);
+    std::size_t GetBudget() const;
+    bool IsBounded() const;
+
+    // Called by any thread evaluating the sheet
+    void RecordHit();
+    void RecordFill(std::size_t bytes);
+    // A cash the sheet cleared or dropped
+    void Release(std::size_t bytes);
+    // Replaces the running count after the cells moved
+    void Recount(std::size_t bytes);
+
+    // Once the cashes pass the budget by a slack (an eighth of it), visits
+    // positions after the hand until they fit the budget, giving up after two
+    // turns; a whole turn also recounts the resident bytes. Between sweeps a
+    // call costs one comparison. Only the writer calls it, while nothing else
+    // evaluates the sheet.
+    void Trim(const std::set<Position>& positions, const std::function<Visit(Position)>& visit);
+
+    std::size_t GetResidentBytes() const;
+    std::uint64_t GetHits() const;
+    std::uint64_t GetMisses() const;
+    std::uint64_t GetEvictions() const;
+
+private:
+    static constexpr std::size_t SLACK = 8;
+
+    std::size_t budget = 0;
+    // where the next sweep starts: the budget itself right after it is set
+    std::size_t trim_above = 0;
+    std::atomic<std::size_t> resident{0};
+    Position hand = Position::NONE;
+
+    std::atomic<std::uint64_t> hits{0};
+    std::atomic<std::uint64_t> misses{0};
+    std::uint64_t evictions = 0;
+};
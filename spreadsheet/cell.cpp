@@ -1,11 +1,16 @@
 #include "cell.h"
 
+#include "allocations.h"
+#include "memory.h"
+#include "metrics.h"
+
 #include <cassert>
 #include <iostream>
 #include <string>
-#include <optional>
+#include <memory>
+#include <thread>
 
-Cell::Value Cell::CellContent::GetValue(Sheet&) const
+Cell::Value Cell::CellContent::GetValue(const CellValueSource&) const
 {
 	return "";
 }
@@ -13,12 +18,17 @@ std::string Cell::CellContent::GetText() const
 {
 	return "";
 }
-std::vector<Position> Cell::CellContent::GetReferencedCells() const
+const std::vector<Position>& Cell::CellContent::GetReferencedCells() const
+{
+	static const std::vector<Position> none;
+	return none;
+}
+std::size_t Cell::CellContent::GetMemoryUsage() const
 {
-	return std::vector<Position>();
+	return Memory::Shared<CellContent>();
 }
 
-Cell::Value Cell::TextCell::GetValue(Sheet&) const
+Cell::Value Cell::TextCell::GetValue(const CellValueSource&) const
 {
 	if (text.empty())
 		return text;
@@ -32,12 +42,12 @@ std::string Cell::TextCell::GetText() const
 {
 	return text;
 }
-std::vector<Position> Cell::TextCell::GetReferencedCells() const
+std::size_t Cell::TextCell::GetMemoryUsage() const
 {
-	return std::vector<Position>();
+	return Memory::Shared<TextCell>() + Memory::Heap(text);
 }
 
-Cell::Value Cell::NumberCell::GetValue(Sheet& sheet) const
+Cell::Value Cell::NumberCell::GetValue(const CellValueSource&) const
 {
 	return value;
 }
@@ -48,14 +58,14 @@ std::string Cell::NumberCell::GetText() const
 	str.erase(str.find_last_not_of('.') + 1, std::string::npos);
 	return str;
 }
-std::vector<Position> Cell::NumberCell::GetReferencedCells() const
+std::size_t Cell::NumberCell::GetMemoryUsage() const
 {
-	return std::vector<Position>();
+	return Memory::Shared<NumberCell>();
 }
 
-Cell::Value Cell::FormulaCell::GetValue(Sheet& sheet) const
+Cell::Value Cell::FormulaCell::GetValue(const CellValueSource& source) const
 {
-	auto value = formula->Evaluate(sheet);
+	auto value = formula->Evaluate(source);
 
 	if (std::holds_alternative<double>(value))
 		return std::get<double>(value);
@@ -66,68 +76,253 @@ std::string Cell::FormulaCell::GetText() const
 {
 	return FORMULA_SIGN + formula->GetExpression();
 }
-std::vector<Position> Cell::FormulaCell::GetReferencedCells() const
+const std::vector<Position>& Cell::FormulaCell::GetReferencedCells() const
 {
 	return formula->GetReferencedCells();
 }
+std::size_t Cell::FormulaCell::GetMemoryUsage() const
+{
+	return Memory::Shared<FormulaCell>();
+}
 
 void Cell::Set(std::string text)
 {
-	std::unique_ptr<CellContent> prev_content(content.release());
 	if (text.empty())
 	{
-		content = std::make_unique<CellContent>(CellContent());
+		content = std::make_shared<CellContent>();
 	}
 	else if (text[0] == FORMULA_SIGN && text.length() != 1)
 	{
 		try
 		{
-			content = std::make_unique<CellContent>(FormulaCell(ParseFormula(text.substr(1))));
+			content = std::make_shared<FormulaCell>(sheet_ref.GetFormulaCache().Get(std::string_view(text).substr(1)));
 		}
 		catch (const std::exception& exc)
 		{
-			content = move(prev_content);
 			std::throw_with_nested(FormulaException(exc.what()));
 		}
 	}
 	else
 	{
-			char* end;
-			double value = std::strtod(text.data(), &end);
-			if (*end == text.back())
-				content = std::make_unique<CellContent>(NumberCell(value));
-			else
-				content = std::make_unique<CellContent>(TextCell(std::move(text)));
+		char* end;
+		double value = std::strtod(text.data(), &end);
+		if (end == text.data() + text.size())
+			content = std::make_shared<NumberCell>(value);
+		else
+			content = std::make_shared<TextCell>(std::move(text));
 	}
-	prev_content.release();
-	cash = {};
+	ClearCash();
 }
 void Cell::Clear()
 {
-	content.release();
-	content = std::unique_ptr<CellContent>(new CellContent());
+	content = std::make_shared<CellContent>();
+	ClearCash();
 }
 
 Cell::Value Cell::GetValue() const
 {
-	if (cash.has_value())
-		return cash.value();
+	return GetValue(sheet_ref);
+}
+Cell::Value Cell::GetValue(const CellValueSource& source) const
+{
+	SPREADSHEET_ALLOCATION_SCOPE("Cell::GetValue");
+	CashState state = cash_state.load(std::memory_order_acquire);
 
-	CellInterface::Value value = content->GetValue(sheet_ref);
-	cash = value;
+	if (state == CashState::Ready)
+	{
+		SPREADSHEET_METRIC_ADD(CashHits, 1);
+		NoteCashRead(source, false);
+		return cash;
+	}
 
-	return value;
+	while (state != CashState::Ready)
+	{
+		if (state == CashState::Empty && cash_state.compare_exchange_weak(state, CashState::Computing, std::memory_order_acquire))
+		{
+			SPREADSHEET_METRIC_ADD(CashMisses, 1);
+
+			try
+			{
+				cash = Compute(source);
+			}
+			catch (...)
+			{
+				cash_state.store(CashState::Empty, std::memory_order_release);
+				throw;
+			}
+			cash_state.store(CashState::Ready, std::memory_order_release);
+			NoteCashRead(source, true);
+			break;
+		}
+
+		// another reader is evaluating this cell: wait for its result instead of repeating the work
+		if (state == CashState::Computing)
+		{
+			std::this_thread::yield();
+			state = cash_state.load(std::memory_order_acquire);
+		}
+	}
+
+	return cash;
 }
 std::string Cell::GetText() const
 {
+	SPREADSHEET_ALLOCATION_SCOPE("Cell::GetText");
 	return content->GetText();
 }
-std::vector<Position> Cell::GetReferencedCells() const
+const std::vector<Position>& Cell::GetReferencedCells() const
 {
 	return content->GetReferencedCells();
 }
+const std::vector<SheetReference>& Cell::GetSheetReferences() const
+{
+	static const std::vector<SheetReference> none;
+
+	if (const auto* formula_cell = dynamic_cast<const FormulaCell*>(content.get()))
+		return formula_cell->GetFormula().GetSheetReferences();
+	else
+		return none;
+}
+
+Cell::Value Cell::Compute(const CellValueSource& source) const
+{
+	EvaluationProfiler* profiler = sheet_ref.GetProfiler();
+
+	if (profiler && dynamic_cast<const FormulaCell*>(content.get()))
+	{
+		EvaluationProfiler::Scope scope(*profiler, this);
+		return content->GetValue(source);
+	}
+	else
+		return content->GetValue(source);
+}
+
+void Cell::NoteCashRead(const CellValueSource& source, bool filled) const
+{
+	if (!cash_used.load(std::memory_order_relaxed))
+		cash_used.store(true, std::memory_order_relaxed);
+
+	// snapshots read the cells they share with the sheet: only the sheet's own reads count
+	if (&source != static_cast<const CellValueSource*>(&sheet_ref))
+		return;
+
+	CashPool& pool = sheet_ref.GetCashPool();
+	if (!pool.IsBounded())
+		return;
+
+	if (filled)
+		pool.RecordFill(GetCashSize());
+	else
+		pool.RecordHit();
+}
+
+FormulaInterface::HandlingResult Cell::HandleShift(const ReferenceShift& shift)
+{
+	const auto* formula_cell = dynamic_cast<const FormulaCell*>(content.get());
+
+	if (!formula_cell)
+		return FormulaInterface::HandlingResult::NothingChanged;
+
+	// the formula may be shared with the parse cache, other cells and snapshots: shift a copy
+	std::unique_ptr<FormulaInterface> formula = formula_cell->GetFormula().Clone();
+	auto result = formula->HandleShift(shift);
+
+	if (result == FormulaInterface::HandlingResult::NothingChanged)
+		return result;
+
+	content = std::make_shared<FormulaCell>(std::move(formula));
+	if (result == FormulaInterface::HandlingResult::ReferencesChanged)
+		ClearCash();
+
+	return result;
+}
 
 void Cell::ClearCash()
 {
-	cash = {};
+	cash_state.store(CashState::Empty, std::memory_order_release);
+}
+std::optional<Cell::Value> Cell::GetCashedValue() const
+{
+	if (cash_state.load(std::memory_order_acquire) == CashState::Ready)
+		return cash;
+	else
+		return std::nullopt;
+}
+void Cell::FillCash(Value value) const
+{
+	CashState state = CashState::Empty;
+
+	if (cash_state.compare_exchange_strong(state, CashState::Computing, std::memory_order_acquire))
+	{
+		cash = std::move(value);
+		cash_state.store(CashState::Ready, std::memory_order_release);
+	}
+}
+std::size_t Cell::GetCashSize() const
+{
+	if (cash_state.load(std::memory_order_acquire) != CashState::Ready)
+		return 0;
+
+	if (std::holds_alternative<std::string>(cash))
+		return sizeof(cash) + Memory::Heap(std::get<std::string>(cash));
+	else
+		return sizeof(cash);
+}
+bool Cell::TakeCashUse() const
+{
+	return cash_used.exchange(false, std::memory_order_relaxed);
+}
+bool Cell::EvictCash() const
+{
+	CashState state = CashState::Ready;
+
+	if (!cash_state.compare_exchange_strong(state, CashState::Computing, std::memory_order_acquire))
+		return false;
+
+	cash = 0.0;
+	cash_state.store(CashState::Empty, std::memory_order_release);
+	return true;
+}
+const FormulaInterface* Cell::GetFormula() const
+{
+	if (const auto* formula_cell = dynamic_cast<const FormulaCell*>(content.get()))
+		return &formula_cell->GetFormula();
+	else
+		return nullptr;
+}
+void Cell::AddMemoryUsage(MemoryReport& report, std::unordered_set<const void*>& counted) const
+{
+	report.storage += Memory::Shared<Cell>() - sizeof(cash);
+	report.values += sizeof(cash);
+	if (cash_state.load(std::memory_order_acquire) == CashState::Ready && std::holds_alternative<std::string>(cash))
+		report.values += Memory::Heap(std::get<std::string>(cash));
+
+	if (!counted.insert(content.get()).second)
+		return;
+
+	if (const auto* formula_cell = dynamic_cast<const FormulaCell*>(content.get()))
+	{
+		report.formulas += content->GetMemoryUsage();
+		if (counted.insert(&formula_cell->GetFormula()).second)
+			report.formulas += formula_cell->GetFormula().GetMemoryUsage();
+	}
+	else
+		report.texts += content->GetMemoryUsage();
+}
+std::shared_ptr<Cell> Cell::CloneWithoutCash() const
+{
+	auto clone = std::make_shared<Cell>(sheet_ref);
+	clone->content = content;
+	return clone;
+}
+std::shared_ptr<Cell> Cell::CloneMoved(int row_offset, int col_offset) const
+{
+	auto clone = std::make_shared<Cell>(sheet_ref);
+
+	if (const auto* formula_cell = dynamic_cast<const FormulaCell*>(content.get()))
+		clone->content = std::make_shared<FormulaCell>(formula_cell->GetFormula().CloneMoved(row_offset, col_offset));
+	else
+		clone->content = content;
+
+	return clone;
 }
@@ -4,45 +4,82 @@
 #include "formula.h"
 #include "sheet.h"
 
+#include <atomic>
 #include <forward_list>
+#include <memory>
 #include <optional>
+#include <unordered_set>
 
 class Sheet;
+struct MemoryReport;
 
 class Cell : public CellInterface
 {
 public:
-    Cell(Sheet& sheet) : sheet_ref(sheet), content(std::unique_ptr<CellContent>(new CellContent())) { }
-    ~Cell()
-    {
-        content.release();
-    }
+    Cell(Sheet& sheet) : sheet_ref(sheet), content(std::make_shared<CellContent>()) { }
 
     void Set(std::string text);
     void Clear();
 
     Value GetValue() const override;
+    Value GetValue(const CellValueSource& source) const;
     std::string GetText() const override;
-    std::vector<Position> GetReferencedCells() const override;
+    const std::vector<Position>& GetReferencedCells() const override;
+    const std::vector<SheetReference>& GetSheetReferences() const;
+
+    // Rewrites the references of a formula cell after a structural edit; the
+    // cash survives unless a referenced cell was deleted
+    FormulaInterface::HandlingResult HandleShift(const ReferenceShift& shift);
 
     void ClearCash();
+    // The cashed value, if the cell has been evaluated since it was last cleared
+    std::optional<Value> GetCashedValue() const;
+    // Cashes a value computed elsewhere (see BatchEvaluator), unless the cell
+    // is cashed or being evaluated already
+    void FillCash(Value value) const;
+    // Bytes the cashed value holds, zero if there is none
+    std::size_t GetCashSize() const;
+    // Clears the mark every read of the cash leaves (see CashPool); true if it was set
+    bool TakeCashUse() const;
+    // Drops a ready cash, releasing the text of a string; false if the cell
+    // has none or is being evaluated
+    bool EvictCash() const;
+    // nullptr unless the cell holds a formula
+    const FormulaInterface* GetFormula() const;
+    // Adds the cell to the report; contents and formulas found in `counted`
+    // belong to a cell counted before, and are not added again
+    void AddMemoryUsage(MemoryReport& report, std::unordered_set<const void*>& counted) const;
+    // Shares the (immutable) content, but starts with an empty cash
+    std::shared_ptr<Cell> CloneWithoutCash() const;
+    // The cell copied `offset` rows and columns away (see FormulaInterface::CloneMoved);
+    // other contents are shared
+    std::shared_ptr<Cell> CloneMoved(int row_offset, int col_offset) const;
 
 private:
+    Value Compute(const CellValueSource& source) const;
+    // Marks the cash as used and, for reads through a bounded sheet, counts them there
+    void NoteCashRead(const CellValueSource& source, bool filled) const;
+
     class CellContent
     {
     public:
-        virtual Value GetValue(Sheet& sheet) const;
+        virtual ~CellContent() = default;
+
+        virtual Value GetValue(const CellValueSource& source) const;
         virtual std::string GetText() const;
-        virtual std::vector<Position> GetReferencedCells() const;
+        // empty unless overridden
+        virtual const std::vector<Position>& GetReferencedCells() const;
+        // Bytes of the content as make_shared allocated it; a formula counts on its own
+        virtual std::size_t GetMemoryUsage() const;
     };
     class TextCell : public CellContent
     {
     public:
         explicit TextCell(std::string&& text) : text(text) {}
 
-        Value GetValue(Sheet& sheet) const override;
+        Value GetValue(const CellValueSource& source) const override;
         std::string GetText() const override;
-        std::vector<Position> GetReferencedCells() const override;
+        std::size_t GetMemoryUsage() const override;
 
     private:
         std::string text;
@@ -52,9 +89,9 @@ private:
     public:
         explicit NumberCell(double v) : value(v) {}
 
-        Value GetValue(Sheet& sheet) const override;
+        Value GetValue(const CellValueSource& source) const override;
         std::string GetText() const override;
-        std::vector<Position> GetReferencedCells() const override;
+        std::size_t GetMemoryUsage() const override;
 
     private:
         double value;
@@ -62,17 +99,38 @@ private:
     class FormulaCell : public CellContent
     {
     public:
-        explicit FormulaCell(std::unique_ptr<FormulaInterface> f) : formula(std::move(f)) {}
+        explicit FormulaCell(std::shared_ptr<const FormulaInterface> f) : formula(std::move(f)) {}
 
-        Value GetValue(Sheet& sheet) const override;
+        Value GetValue(const CellValueSource& source) const override;
         std::string GetText() const override;
-        std::vector<Position> GetReferencedCells() const override;
+        const std::vector<Position>& GetReferencedCells() const override;
+        std::size_t GetMemoryUsage() const override;
+
+        const FormulaInterface& GetFormula() const
+        {
+            return *formula;
+        }
 
     private:
-        std::unique_ptr<FormulaInterface> formula;
+        // shared with the parse cache and other cells: never changed
+        std::shared_ptr<const FormulaInterface> formula;
+    };
+
+    // Snapshot readers may fill the cash of a shared cell concurrently: the
+    // thread that moves cash_state from Empty to Computing is the only one to
+    // evaluate, and publishes cash with the release store of Ready
+    enum class CashState : unsigned char
+    {
+        Empty,
+        Computing,
+        Ready,
     };
 
     Sheet& sheet_ref;
-    std::unique_ptr<CellContent> content;
-    mutable std::optional<CellInterface::Value> cash;
+    // never changed while another cell (or a snapshot copy of this one) shares it
+    std::shared_ptr<CellContent> content;
+    mutable std::atomic<CashState> cash_state = CashState::Empty;
+    // the reference bit of the CLOCK a bounded sheet runs over its cashes
+    mutable std::atomic<bool> cash_used = false;
+    mutable CellInterface::Value cash;
 };
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <climits>
 #include <iosfwd>
 #include <memory>
 #include <stdexcept>
@@ -8,6 +9,14 @@
 #include <variant>
 #include <vector>
 
+// The largest sheet a build supports; the defaults are those of Excel
+#ifndef SPREADSHEET_MAX_ROWS
+#define SPREADSHEET_MAX_ROWS 1048576
+#endif
+#ifndef SPREADSHEET_MAX_COLS
+#define SPREADSHEET_MAX_COLS 16384
+#endif
+
 struct Position
 {
     int row = 0;
@@ -21,10 +30,52 @@ struct Position
 
     static Position FromString(std::string_view str);
 
-    static const int MAX_ROWS = 16384;
-    static const int MAX_COLS = 16384;
+    // Compile-time caps; nothing is sized by them, so they can be large
+    static const int MAX_ROWS = SPREADSHEET_MAX_ROWS;
+    static const int MAX_COLS = SPREADSHEET_MAX_COLS;
     static const Position NONE;
+
+    // The limits IsValid() checks, for every sheet: the caps unless lowered.
+    // Set them before creating sheets; cells beyond new limits become unreachable.
+    static int GetMaxRows();
+    static int GetMaxCols();
+    // Throws InvalidPositionException unless 0 < limit <= cap
+    static void SetLimits(int max_rows, int max_cols);
+};
+// room for a shift past the last row or column
+static_assert(Position::MAX_ROWS > 0 && Position::MAX_ROWS <= INT_MAX / 2, "SPREADSHEET_MAX_ROWS out of range");
+static_assert(Position::MAX_COLS > 0 && Position::MAX_COLS <= INT_MAX / 2, "SPREADSHEET_MAX_COLS out of range");
+// One structural edit along an axis: coordinates at or after `first` move by
+// `delta`. A negative delta deletes [first, first - delta), and positions in
+// that range become invalid (they print as #REF! in formulas).
+struct ReferenceShift
+{
+    enum class Axis
+    {
+        Rows,
+        Cols,
+    };
+
+    Axis axis;
+    int first;
+    int delta;
+
+    bool Affects(Position pos) const;
+    Position Apply(Position pos) const;
+};
+
+// A cell of another sheet of the same workbook, written as Sheet2!A1 in formulas
+struct SheetReference
+{
+    std::string sheet;
+    Position pos;
+
+    bool operator==(const SheetReference& rhs) const;
+    bool operator<(const SheetReference& rhs) const;
+
+    std::string ToString() const;
 };
+
 struct Size
 {
     int rows = 0;
@@ -72,6 +123,11 @@ class CircularDependencyException : public std::runtime_error
 public:
     using std::runtime_error::runtime_error;
 };
+class TableTooBigException : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
 
 class CellInterface
 {
@@ -82,7 +138,20 @@ public:
 
     virtual Value GetValue() const = 0;
     virtual std::string GetText() const = 0;
-    virtual std::vector<Position> GetReferencedCells() const = 0;
+    // Sorted and without duplicates
+    virtual const std::vector<Position>& GetReferencedCells() const = 0;
+};
+
+// Anything formulas can read referenced cell values from: the live sheet or
+// one of its published snapshots.
+class CellValueSource
+{
+public:
+    virtual ~CellValueSource() = default;
+
+    virtual CellInterface::Value GetCellValue(Position pos) const = 0;
+    // Only a sheet of a workbook knows its siblings: #REF! everywhere else
+    virtual CellInterface::Value GetSheetCellValue(const SheetReference& ref) const;
 };
 
 inline constexpr char FORMULA_SIGN = '=';
@@ -1,58 +1,207 @@
 #include "formula.h"
 
 #include "FormulaAST.h"
+#include "allocations.h"
+#include "memory.h"
+#include "metrics.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <optional>
 #include <sstream>
 
 using namespace std::literals;
 
+bool FormulaProgram::IsShiftedBy(const FormulaProgram& other, int row_offset) const
+{
+    if (code != other.code || numbers != other.numbers || loads.size() != other.loads.size())
+        return false;
+
+    for (std::size_t i = 0; i < loads.size(); ++i)
+    {
+        if (other.loads[i].row != loads[i].row + row_offset || other.loads[i].col != loads[i].col)
+            return false;
+    }
+
+    return true;
+}
+
 namespace
 {
+    class SheetValueSource : public CellValueSource
+    {
+    public:
+        explicit SheetValueSource(const SheetInterface& sheet) : sheet(sheet) { }
+
+        CellInterface::Value GetCellValue(Position pos) const override
+        {
+            const CellInterface* cell = sheet.GetCell(pos);
+
+            if (!cell)
+                return 0.0;
+            else
+                return cell->GetValue();
+        }
+
+    private:
+        const SheetInterface& sheet;
+    };
+
     class Formula : public FormulaInterface
     {
     public:
-        explicit Formula(std::string expression) : ast(ParseFormulaAST(expression)) { }
+        explicit Formula(std::string_view expression) : ast(ParseFormulaAST(expression))
+        {
+            Precompute();
+        }
+        explicit Formula(FormulaAST ast) : ast(std::move(ast))
+        {
+            Precompute();
+        }
         Value Evaluate(const SheetInterface& sheet) const override
         {
+            return Evaluate(SheetValueSource(sheet));
+        }
+        Value Evaluate(const CellValueSource& source) const override
+        {
+            SPREADSHEET_METRIC_ADD(Evaluations, 1);
+
             try
             {
-                return ast.Execute(sheet);
+                return ast.Execute(source);
             }
             catch (const FormulaError& exc)
             {
                 return exc;
             }
         }
-        std::string GetExpression() const override
+        const std::string& GetExpression() const override
         {
-            std::stringstream result;
-            ast.PrintFormula(result);
-            return result.str();
+            return expression;
         }
-        std::vector<Position> GetReferencedCells() const override
+        const std::vector<Position>& GetReferencedCells() const override
         {
-            std::set<Position> result;
+            return referenced_cells;
+        }
+        const std::vector<SheetReference>& GetSheetReferences() const override
+        {
+            return sheet_references;
+        }
+        const FormulaProgram* GetProgram() const override
+        {
+            return program ? &*program : nullptr;
+        }
+        std::size_t GetMemoryUsage() const override
+        {
+            std::size_t result = sizeof(*this) + ast.GetMemoryUsage() + Memory::Heap(expression) + Memory::Heap(referenced_cells) + Memory::Heap(sheet_references);
+            for (const SheetReference& ref : sheet_references)
+            {
+                result += Memory::Heap(ref.sheet);
+            }
+            if (program)
+                result += Memory::Heap(program->code) + Memory::Heap(program->loads) + Memory::Heap(program->numbers);
+
+            return result;
+        }
+
+        HandlingResult HandleShift(const ReferenceShift& shift) override
+        {
+            HandlingResult result = HandlingResult::NothingChanged;
+
             for (const Position& pos : ast.GetCells())
             {
-                result.insert(pos);
+                if (!pos.IsValid() || !shift.Affects(pos))
+                    continue;
+
+                if (shift.Apply(pos).IsValid())
+                    result = std::max(result, HandlingResult::ReferencesRenamedOnly);
+                else
+                    result = HandlingResult::ReferencesChanged;
             }
 
-            return { result.begin(), result.end() };
+            if (result != HandlingResult::NothingChanged)
+            {
+                ast.RemapCells([&shift](Position pos) { return shift.Apply(pos); });
+                Precompute();
+            }
+
+            return result;
+        }
+        std::unique_ptr<FormulaInterface> Clone() const override
+        {
+            return std::make_unique<Formula>(ast.Clone());
+        }
+        std::unique_ptr<FormulaInterface> CloneMoved(int row_offset, int col_offset) const override
+        {
+            auto move = [row_offset, col_offset](Position pos)
+            {
+                if (!pos.IsValid())
+                    return pos;
+
+                Position moved{pos.row + row_offset, pos.col + col_offset};
+                return moved.IsValid() ? moved : Position::NONE;
+            };
+
+            FormulaAST copy = ast.Clone();
+            copy.RemapCells(move);
+            copy.RemapSheetCells(move);
+
+            return std::make_unique<Formula>(std::move(copy));
         }
 
     private:
+        void Precompute()
+        {
+            std::ostringstream text;
+            ast.PrintFormula(text);
+            expression = text.str();
+
+            referenced_cells.clear();
+            for (const Position& pos : ast.GetCells())
+            {
+                // deleted references (#REF!) point nowhere
+                if (pos.IsValid())
+                    referenced_cells.push_back(pos);
+            }
+            // the AST keeps its cells sorted, and shifts preserve the order
+            if (!std::is_sorted(referenced_cells.begin(), referenced_cells.end()))
+                std::sort(referenced_cells.begin(), referenced_cells.end());
+            referenced_cells.erase(std::unique(referenced_cells.begin(), referenced_cells.end()), referenced_cells.end());
+
+            sheet_references.clear();
+            for (const SheetReference& ref : ast.GetSheetCells())
+            {
+                if (ref.pos.IsValid())
+                    sheet_references.push_back(ref);
+            }
+            std::sort(sheet_references.begin(), sheet_references.end());
+            sheet_references.erase(std::unique(sheet_references.begin(), sheet_references.end()), sheet_references.end());
+
+            FormulaProgram compiled;
+            if (ast.Compile(compiled))
+                program = std::move(compiled);
+            else
+                program.reset();
+        }
+
         FormulaAST ast;
+        std::string expression;
+        std::vector<Position> referenced_cells;
+        std::vector<SheetReference> sheet_references;
+        std::optional<FormulaProgram> program;
     };
 }
 
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression)
+std::unique_ptr<FormulaInterface> ParseFormula(std::string_view expression)
 {
+    SPREADSHEET_ALLOCATION_SCOPE("ParseFormula");
+    SPREADSHEET_METRIC_ADD(FormulaParses, 1);
+    SPREADSHEET_METRIC_TIMER(ParseNanoseconds);
+
     try
     {
-        return std::make_unique<Formula>(std::move(expression));
+        return std::make_unique<Formula>(expression);
     }
     catch (const std::exception& e)
     {
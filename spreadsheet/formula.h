@@ -3,18 +3,68 @@
 #include "common.h"
 
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 
+// A formula as a flat postfix program over a stack of numbers, for evaluating
+// many cells of one shape at once (see BatchEvaluator). Only formulas that
+// read cells of their own sheet and have no #REF! compile to a program.
+struct FormulaProgram
+{
+    enum class Op : unsigned char
+    {
+        Load,    // pushes the value of the next cell of `loads`
+        Number,  // pushes the next number of `numbers`
+        Negate,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+    };
+
+    std::vector<Op> code;
+    std::vector<Position> loads;
+    std::vector<double> numbers;
+    int depth = 0;  // the deepest the stack gets
+
+    // Whether `other` is this program moved `row_offset` rows down: the same
+    // code and numbers, with every load as many rows further
+    bool IsShiftedBy(const FormulaProgram& other, int row_offset) const;
+};
+
 class FormulaInterface
 {
 public:
     using Value = std::variant<double, FormulaError>;
 
+    enum class HandlingResult
+    {
+        NothingChanged,         // no reference was affected
+        ReferencesRenamedOnly,  // references moved together with their cells: the value is the same
+        ReferencesChanged,      // a referenced cell was deleted: the value has to be recomputed
+    };
+
     virtual ~FormulaInterface() = default;
 
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
-    virtual std::string GetExpression() const = 0;
-    virtual std::vector<Position> GetReferencedCells() const = 0;
+    virtual Value Evaluate(const CellValueSource& source) const = 0;
+    // The canonical text and the references are computed once, when the
+    // formula is parsed or its references change, and returned without copying
+    virtual const std::string& GetExpression() const = 0;
+    virtual const std::vector<Position>& GetReferencedCells() const = 0;
+    // Cells of other sheets, sorted and without duplicates
+    virtual const std::vector<SheetReference>& GetSheetReferences() const = 0;
+    // nullptr when the formula does not compile to a program
+    virtual const FormulaProgram* GetProgram() const = 0;
+    // Bytes of the formula: the tree, the canonical text, the reference lists and the program
+    virtual std::size_t GetMemoryUsage() const = 0;
+
+    virtual HandlingResult HandleShift(const ReferenceShift& shift) = 0;
+    virtual std::unique_ptr<FormulaInterface> Clone() const = 0;
+    // The formula copied to a cell `offset` rows and columns away: every
+    // reference moves with it, and the ones that leave the sheet become #REF!
+    virtual std::unique_ptr<FormulaInterface> CloneMoved(int row_offset, int col_offset) const = 0;
 };
 
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string_view expression);
\ No newline at end of file
@@ -0,0 +1,118 @@
+#include "formula_cache.h"
+
+#include "allocations.h"
+#include "memory.h"
+#include "metrics.h"
+
+#include <cctype>
+
+namespace
+{
+    bool IsOperator(char ch)
+    {
+        return ch == '+' || ch == '-' || ch == '*' || ch == '/' || ch == '(' || ch == ')';
+    }
+
+    // The lexer skips whitespace, so dropping it does not change the formula,
+    // except between two characters that would otherwise join into one token
+    // ("1 2" has to stay an error)
+    std::string Normalize(std::string_view expression)
+    {
+        std::string result;
+        result.reserve(expression.size());
+
+        for (std::size_t i = 0; i < expression.size(); ++i)
+        {
+            if (!std::isspace(static_cast<unsigned char>(expression[i])))
+            {
+                result += expression[i];
+                continue;
+            }
+
+            std::size_t next = i;
+            while (next < expression.size() && std::isspace(static_cast<unsigned char>(expression[next])))
+            {
+                ++next;
+            }
+
+            if (!result.empty() && next < expression.size() && !IsOperator(result.back()) && !IsOperator(expression[next]))
+                result += ' ';
+
+            i = next - 1;
+        }
+
+        return result;
+    }
+}
+
+std::shared_ptr<const FormulaInterface> FormulaCache::Get(std::string_view expression)
+{
+    SPREADSHEET_ALLOCATION_SCOPE("FormulaCache::Get");
+    if (capacity == 0)
+        return ParseFormula(expression);
+
+    std::string key = Normalize(expression);
+
+    if (auto it = lookup.find(key); it != lookup.end())
+    {
+        ++hits;
+        SPREADSHEET_METRIC_ADD(FormulaCacheHits, 1);
+
+        entries.splice(entries.begin(), entries, it->second);
+        return it->second->second;
+    }
+
+    ++misses;
+    SPREADSHEET_METRIC_ADD(FormulaCacheMisses, 1);
+
+    std::shared_ptr<const FormulaInterface> formula = ParseFormula(key);
+    entries.emplace_front(std::move(key), formula);
+    lookup.emplace(entries.front().first, entries.begin());
+    Trim();
+
+    return formula;
+}
+
+void FormulaCache::SetCapacity(std::size_t entries)
+{
+    capacity = entries;
+    Trim();
+}
+
+std::size_t FormulaCache::GetSize() const
+{
+    return entries.size();
+}
+std::uint64_t FormulaCache::GetHits() const
+{
+    return hits;
+}
+std::uint64_t FormulaCache::GetMisses() const
+{
+    return misses;
+}
+
+std::size_t FormulaCache::GetMemoryUsage(std::unordered_set<const void*>& counted) const
+{
+    // a list node has two links, an unordered_map node one link and the hash
+    std::size_t result = lookup.bucket_count() * sizeof(void*)
+        + entries.size() * (Memory::ListNode<Entry>() + sizeof(void*) + Memory::ListNode<decltype(lookup)::value_type>() + sizeof(std::size_t));
+
+    for (const auto& [key, formula] : entries)
+    {
+        result += Memory::Heap(key);
+        if (counted.insert(formula.get()).second)
+            result += formula->GetMemoryUsage();
+    }
+
+    return result;
+}
+
+void FormulaCache::Trim()
+{
+    while (entries.size() > capacity)
+    {
+        lookup.erase(entries.back().first);
+        entries.pop_back();
+    }
+}
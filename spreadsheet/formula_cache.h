@@ -0,0 +1,49 @@
+#pragma once
+
+#include "formula.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+// Bounded LRU map from normalized formula text to its parsed formula. The
+// formulas are immutable and shared by every cell with the same text, so a
+// repeated text costs a lookup instead of a parse.
+class FormulaCache
+{
+public:
+    static const std::size_t DEFAULT_CAPACITY = 4096;
+
+    // Parses on a miss; parse errors are thrown every time and never cached
+    std::shared_ptr<const FormulaInterface> Get(std::string_view expression);
+
+    // Zero disables the cache
+    void SetCapacity(std::size_t entries);
+
+    std::size_t GetSize() const;
+    std::uint64_t GetHits() const;
+    std::uint64_t GetMisses() const;
+
+    // Bytes of the keys and the maps, plus the formulas not in `counted`,
+    // which no cell shares; adds the formulas to `counted`
+    std::size_t GetMemoryUsage(std::unordered_set<const void*>& counted) const;
+
+private:
+    using Entry = std::pair<std::string, std::shared_ptr<const FormulaInterface>>;
+
+    void Trim();
+
+    std::list<Entry> entries;  // the most recently used first
+    // keys point into `entries`, whose nodes never move
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> lookup;
+    std::size_t capacity = DEFAULT_CAPACITY;
+
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+};
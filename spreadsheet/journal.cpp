@@ -0,0 +1,95 @@
+#include "journal.h"
+
+void EditJournal::Record(Step step)
+{
+    if (step.empty())
+        return;
+
+    for (const Step& s : redo)
+    {
+        size -= SizeOf(s);
+    }
+    redo.clear();
+
+    PushUndo(std::move(step));
+}
+
+std::optional<EditJournal::Step> EditJournal::PopUndo()
+{
+    if (undo.empty())
+        return std::nullopt;
+
+    Step step = std::move(undo.back());
+    undo.pop_back();
+    size -= SizeOf(step);
+
+    return step;
+}
+std::optional<EditJournal::Step> EditJournal::PopRedo()
+{
+    if (redo.empty())
+        return std::nullopt;
+
+    Step step = std::move(redo.back());
+    redo.pop_back();
+    size -= SizeOf(step);
+
+    return step;
+}
+void EditJournal::PushUndo(Step step)
+{
+    size += SizeOf(step);
+    undo.push_back(std::move(step));
+    Trim();
+}
+void EditJournal::PushRedo(Step step)
+{
+    size += SizeOf(step);
+    redo.push_back(std::move(step));
+    Trim();
+}
+
+void EditJournal::Clear()
+{
+    undo.clear();
+    redo.clear();
+    size = 0;
+}
+
+void EditJournal::SetBudget(std::size_t bytes)
+{
+    budget = bytes;
+    Trim();
+}
+std::size_t EditJournal::GetSize() const
+{
+    return size;
+}
+
+std::size_t EditJournal::SizeOf(const Step& step)
+{
+    std::size_t result = sizeof(Step) + step.capacity() * sizeof(Change);
+    for (const Change& change : step)
+    {
+        if (change.before)
+            result += change.before->capacity();
+        if (change.after)
+            result += change.after->capacity();
+    }
+
+    return result;
+}
+void EditJournal::Trim()
+{
+    // the oldest history goes first: undo steps from the front, then whatever redo is left
+    while (size > budget && !undo.empty())
+    {
+        size -= SizeOf(undo.front());
+        undo.pop_front();
+    }
+    while (size > budget && !redo.empty())
+    {
+        size -= SizeOf(redo.front());
+        redo.pop_front();
+    }
+}
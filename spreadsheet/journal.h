@@ -0,0 +1,48 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <deque>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Bounded history of sheet edits. Every public edit is one Step: the texts a
+// few positions had before and after it (nullopt when there was no cell).
+// Once the recorded texts outgrow the budget the oldest steps are dropped.
+class EditJournal
+{
+public:
+    static const std::size_t DEFAULT_BUDGET = 4 << 20;
+
+    struct Change
+    {
+        Position pos;
+        std::optional<std::string> before;
+        std::optional<std::string> after;
+    };
+    using Step = std::vector<Change>;
+
+    // A new edit: makes everything undone so far unreachable
+    void Record(Step step);
+
+    std::optional<Step> PopUndo();
+    std::optional<Step> PopRedo();
+    void PushUndo(Step step);
+    void PushRedo(Step step);
+
+    void Clear();
+
+    void SetBudget(std::size_t bytes);
+    std::size_t GetSize() const;
+
+private:
+    static std::size_t SizeOf(const Step& step);
+    void Trim();
+
+    std::deque<Step> undo;
+    std::deque<Step> redo;
+    std::size_t size = 0;
+    std::size_t budget = DEFAULT_BUDGET;
+};
@@ -1,8 +1,17 @@
+#include <algorithm>
 #include <limits>
 #include <cassert>
+#include <thread>
 
+#include "allocations.h"
+#include "batch.h"
 #include "common.h"
 #include "formula.h"
+#include "memory.h"
+#include "recalculator.h"
+#include "sheet.h"
+#include "workbook.h"
+#include "workload.h"
 #include "test_runner_p.h"
 
 using namespace std;
@@ -19,6 +28,25 @@ inline std::ostream& operator<<(std::ostream& output, Size size) {
     return output << "(" << size.rows << ", " << size.cols << ")";
 }
 
+// Fails if the statement allocates more than `budget` times on this thread.
+// Only an allocation tracking build counts; otherwise it just runs the statement.
+#define ASSERT_ALLOCATIONS(statement, budget)                                      \
+  {                                                                                \
+    Allocations::Measurement __assert_allocations_private_measurement;            \
+    statement;                                                                     \
+    std::uint64_t __assert_allocations_private_count =                            \
+        __assert_allocations_private_measurement.Get().allocations;               \
+    if (Allocations::IsEnabled()) {                                                \
+      std::ostringstream __assert_allocations_private_os;                          \
+      __assert_allocations_private_os << #statement << " allocated "              \
+                                      << __assert_allocations_private_count        \
+                                      << " times, budget " << (budget) << ", "     \
+                                      << FILE_NAME << ":" << __LINE__;             \
+      Assert(__assert_allocations_private_count <= (budget),                       \
+             __assert_allocations_private_os.str());                               \
+    }                                                                              \
+  }
+
 inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
     std::visit(
         [&](const auto& x) {
@@ -53,7 +81,7 @@ namespace {
         testSingle(Position{ 0, 701 }, "ZZ1");
         testSingle(Position{ 0, 702 }, "AAA1");
         testSingle(Position{ 136, 2 }, "C137");
-        testSingle(Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 }, "XFD16384");
+        testSingle(Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 }, "XFD1048576");
     }
 
     void TestPositionToStringInvalid() {
@@ -72,8 +100,8 @@ namespace {
         ASSERT(!Position::FromString("A+1").IsValid());
         ASSERT(!Position::FromString("R2D2").IsValid());
         ASSERT(!Position::FromString("C3PO").IsValid());
-        ASSERT(!Position::FromString("XFD16385").IsValid());
-        ASSERT(!Position::FromString("XFE16384").IsValid());
+        ASSERT(!Position::FromString("XFD1048577").IsValid());
+        ASSERT(!Position::FromString("XFE1048576").IsValid());
         ASSERT(!Position::FromString("A1234567890123456789").IsValid());
         ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
     }
@@ -272,10 +300,10 @@ namespace {
 
         try_formula("=X0");
         try_formula("=ABCD1");
-        try_formula("=A123456");
+        try_formula("=A1048577");
         try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
-        try_formula("=XFD16385");
-        try_formula("=XFE16384");
+        try_formula("=XFD1048577");
+        try_formula("=XFE1048576");
         try_formula("=R2D2");
     }
 
@@ -378,6 +406,1120 @@ namespace {
         ASSERT(caught);
         ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
     }
+
+    void TestSnapshotIsolation() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("B1"_pos, "=2*3");
+
+        auto first = sheet.Publish();
+        ASSERT_EQUAL(first->GetCellValue("A2"_pos), CellInterface::Value(2.0));
+
+        sheet.SetCell("A1"_pos, "10");
+        sheet.ClearCell("B1"_pos);
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(11.0));
+        ASSERT_EQUAL(first->GetCellValue("A2"_pos), CellInterface::Value(2.0));
+        ASSERT_EQUAL(first->GetCellText("A1"_pos), "1");
+        ASSERT_EQUAL(first->GetPrintableSize(), (Size{ 2, 2 }));
+
+        std::ostringstream values;
+        first->PrintValues(values);
+        ASSERT_EQUAL(values.str(), "1\t6\n2\t\n");
+
+        auto second = sheet.Publish();
+        ASSERT(second != first);
+        ASSERT(sheet.Publish() == second);
+        ASSERT(sheet.GetSnapshot() == second);
+        ASSERT_EQUAL(second->GetCellValue("A2"_pos), CellInterface::Value(11.0));
+        ASSERT_EQUAL(second->GetCellText("B1"_pos), "");
+
+        // a cursor of a snapshot evaluates against the snapshot, not the sheet
+        sheet.SetCell("C1"_pos, "=A1*2");
+        auto third = sheet.Publish();
+        sheet.SetCell("A1"_pos, "100");
+        auto cursor = third->GetCells("C1"_pos, { 1, 1 });
+        ASSERT(!cursor.Done() && cursor.GetPosition() == "C1"_pos);
+        ASSERT_EQUAL(cursor.GetText(), "=A1*2");
+        ASSERT_EQUAL(cursor.GetValue(), CellInterface::Value(20.0));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(200.0));
+    }
+
+    void TestConcurrentSnapshotReaders() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int i = 1; i < 200; ++i) {
+            sheet.SetCell(Position{ i, 0 }, "=" + Position{ i - 1, 0 }.ToString() + "+1");
+        }
+        auto snapshot = sheet.Publish();
+
+        std::vector<std::thread> readers;
+        std::vector<double> results(8);
+        for (size_t t = 0; t < results.size(); ++t) {
+            readers.emplace_back([&snapshot, &results, t] {
+                results[t] = std::get<double>(snapshot->GetCellValue(Position{ 199, 0 }));
+            });
+        }
+        sheet.SetCell("A1"_pos, "5");
+        for (auto& reader : readers) {
+            reader.join();
+        }
+
+        ASSERT_EQUAL(results, std::vector<double>(8, 200.0));
+        ASSERT_EQUAL(sheet.GetCell(Position{ 199, 0 })->GetValue(), CellInterface::Value(204.0));
+    }
+
+    void TestUndoRedo() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1*2");
+        sheet.SetCell("A1"_pos, "5");
+        sheet.ClearCell("A2"_pos);
+        sheet.SetCell("B1"_pos, "=C1");
+
+        ASSERT(sheet.Undo());
+        ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+        ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+
+        ASSERT(sheet.Undo());
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(10.0));
+
+        ASSERT(sheet.Undo());
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(2.0));
+
+        ASSERT(sheet.Redo());
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(10.0));
+
+        // a new edit drops the redo history
+        sheet.SetCell("A1"_pos, "=A3");
+        ASSERT(!sheet.Redo());
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(0.0));
+
+        // the graph forgets A1 -> A3 on undo, so A3 may reference A1 again
+        ASSERT(sheet.Undo());
+        sheet.SetCell("A3"_pos, "=A1");
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(5.0));
+
+        // a multi-cell step is restored at once: restoring B1 alone would make a cycle with A1
+        Sheet copied;
+        copied.SetCell("A1"_pos, "1");
+        copied.SetCell("B1"_pos, "=A1");
+        copied.SetCell("C1"_pos, "=D1");
+        copied.SetCell("D1"_pos, "1");
+        copied.CopyRange("C1"_pos, { 1, 2 }, "A1"_pos);
+        ASSERT_EQUAL(copied.GetCell("A1"_pos)->GetText(), "=B1");
+        ASSERT(copied.Undo());
+        ASSERT_EQUAL(copied.GetCell("A1"_pos)->GetText(), "1");
+        ASSERT_EQUAL(copied.GetCell("B1"_pos)->GetValue(), CellInterface::Value(1.0));
+        ASSERT(copied.Redo());
+        ASSERT_EQUAL(copied.GetCell("A1"_pos)->GetValue(), CellInterface::Value(1.0));
+        ASSERT(copied.Undo());
+
+        sheet.SetJournalBudget(0);
+        ASSERT(!sheet.Undo());
+    }
+
+    void TestMetrics() {
+#ifdef SPREADSHEET_METRICS
+        Sheet sheet;
+        auto before = Metrics::Collect();
+
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.GetCell("A2"_pos)->GetValue();
+        sheet.GetCell("A2"_pos)->GetValue();
+        sheet.SetCell("A1"_pos, "2");
+
+        auto after = Metrics::Collect();
+        auto delta = [&](Metrics::Counter counter) {
+            return after.Get(counter) - before.Get(counter);
+        };
+        ASSERT_EQUAL(delta(Metrics::Counter::FormulaParses), 1u);
+        ASSERT_EQUAL(delta(Metrics::Counter::Evaluations), 1u);
+        ASSERT_EQUAL(delta(Metrics::Counter::CashHits), 1u);
+        ASSERT_EQUAL(delta(Metrics::Counter::CellsInvalidated), 1u);
+        ASSERT_EQUAL(after.Get(Metrics::Histogram::ParseNanoseconds).count - before.Get(Metrics::Histogram::ParseNanoseconds).count, 1u);
+
+        std::ostringstream out;
+        sheet.PrintMetrics(out);
+        ASSERT(out.str().find("\nspreadsheet_graph_edges 1\n") != std::string::npos);
+        ASSERT(out.str().find("# TYPE spreadsheet_formula_parse_seconds histogram\n") != std::string::npos);
+#endif
+    }
+
+    void TestHotCells() {
+        Sheet sheet;
+        sheet.EnableProfiling(true);
+
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("A3"_pos, "=A2*A2");
+        sheet.GetCell("A3"_pos)->GetValue();
+        sheet.SetCell("A1"_pos, "2");
+        sheet.GetCell("A3"_pos)->GetValue();
+
+        auto hot = sheet.GetHotCells(10);
+        ASSERT_EQUAL(hot.size(), 2u);
+        for (const HotCell& cell : hot) {
+            ASSERT_EQUAL(cell.stats.evaluations, 2u);
+            ASSERT_EQUAL(cell.stats.invalidations, 1u);
+            ASSERT(cell.stats.self_time <= cell.stats.total_time);
+        }
+        auto a3 = std::find_if(hot.begin(), hot.end(), [](const HotCell& cell) { return cell.pos == "A3"_pos; });
+        ASSERT(a3 != hot.end());
+        ASSERT_EQUAL(a3->expression, "A2*A2");
+
+        ASSERT_EQUAL(sheet.GetHotCells(1).size(), 1u);
+
+        sheet.EnableProfiling(false);
+        sheet.SetCell("A1"_pos, "3");
+        sheet.GetCell("A3"_pos)->GetValue();
+        ASSERT_EQUAL(sheet.GetHotCells(10).front().stats.evaluations, 2u);
+    }
+
+    void TestInsertDeleteRowsCols() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("A3"_pos, "=A2*2");
+        sheet.SetCell("B5"_pos, "=A3+C9");
+        ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetValue(), CellInterface::Value(4.0));
+        auto before = sheet.Publish();
+
+        sheet.InsertRows(1, 2);
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "=A1+1");
+        ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetText(), "=A4*2");
+        ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetText(), "=A5+C11");
+        ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetValue(), CellInterface::Value(4.0));
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 7, 2 }));
+
+        sheet.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetValue(), CellInterface::Value(12.0));
+        ASSERT_EQUAL(before->GetCellValue("B5"_pos), CellInterface::Value(4.0));
+
+        sheet.DeleteRows(0);
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=#REF!+1");
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT_EQUAL(sheet.GetCell("B6"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT(sheet.GetCell("A3"_pos)->GetReferencedCells().empty());
+
+        // aligned with the storage blocks: whole blocks move
+        sheet.InsertCols(0, 16);
+        ASSERT_EQUAL(sheet.GetCell("R6"_pos)->GetText(), "=Q4+S10");
+        sheet.SetCell("Q4"_pos, "7");
+        ASSERT_EQUAL(sheet.GetCell("R6"_pos)->GetValue(), CellInterface::Value(7.0));
+
+        sheet.DeleteCols(0, 17);
+        ASSERT_EQUAL(sheet.GetCell("A6"_pos)->GetText(), "=#REF!+B10");
+        ASSERT(!sheet.Undo());
+
+        sheet.SetCell(Position{ Position::MAX_ROWS - 1, 0 }, "last");
+        bool caught = false;
+        try {
+            sheet.InsertRows(0);
+        }
+        catch (const TableTooBigException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        // a count must be positive and fit the axis
+        for (auto shift : std::vector<std::function<void()>>{
+                 [&sheet] { sheet.InsertRows(5, -3); },
+                 [&sheet] { sheet.DeleteRows(0, -2); },
+                 [&sheet] { sheet.InsertCols(0, 0); },
+                 [&sheet] { sheet.DeleteCols(0, Position::MAX_COLS + 1); },
+                 [&sheet] { sheet.InsertRows(0, std::numeric_limits<int>::max()); },
+                 [&sheet] { sheet.DeleteRows(1, std::numeric_limits<int>::min()); } }) {
+            caught = false;
+            try {
+                shift();
+            }
+            catch (const InvalidPositionException&) {
+                caught = true;
+            }
+            ASSERT(caught);
+        }
+        ASSERT_EQUAL(sheet.GetCell("A6"_pos)->GetText(), "=#REF!+B10");
+        sheet.DeleteRows(0, Position::MAX_ROWS);
+        ASSERT(sheet.GetCell("A6"_pos) == nullptr);
+    }
+
+    void TestWorkbook() {
+        Workbook book;
+        Sheet& first = book.AddSheet("Sheet1");
+        Sheet& second = book.AddSheet("Sheet2");
+
+        first.SetCell("A1"_pos, "2");
+        second.SetCell("A1"_pos, "=Sheet1!A1*10");
+        second.SetCell("B1"_pos, "=A1+1");
+        first.SetCell("B2"_pos, "=Sheet2!B1+Later!C3");
+        ASSERT_EQUAL(second.GetCell("A1"_pos)->GetText(), "=Sheet1!A1*10");
+        ASSERT_EQUAL(first.GetCell("B2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT(second.GetCell("A1"_pos)->GetReferencedCells().empty());
+
+        Sheet& later = book.AddSheet("Later");
+        ASSERT_EQUAL(first.GetCell("B2"_pos)->GetValue(), CellInterface::Value(21.0));
+        later.SetCell("C3"_pos, "4");
+        ASSERT_EQUAL(first.GetCell("B2"_pos)->GetValue(), CellInterface::Value(25.0));
+
+        auto before = book.Publish();
+        first.SetCell("A1"_pos, "3");
+        book.Recalculate();
+        ASSERT_EQUAL(second.GetCell("B1"_pos)->GetValue(), CellInterface::Value(31.0));
+        ASSERT_EQUAL(first.GetCell("B2"_pos)->GetValue(), CellInterface::Value(35.0));
+        ASSERT_EQUAL(before->GetSheet("Sheet1")->GetCellValue("B2"_pos), CellInterface::Value(25.0));
+        ASSERT_EQUAL(first.Publish()->GetCellValue("B2"_pos), CellInterface::Value(35.0));
+
+        bool caught = false;
+        try {
+            first.SetCell("A1"_pos, "=Sheet2!A1");
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(first.GetCell("A1"_pos)->GetText(), "3");
+
+        // the cycle leaves the sheet from a cell downstream of the edited one
+        first.SetCell("C1"_pos, "=A1");
+        second.SetCell("C1"_pos, "=Sheet1!C1");
+        first.SetCell("D1"_pos, "=Sheet2!C1");
+        caught = false;
+        try {
+            first.SetCell("A1"_pos, "=D1");
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        // a formula reading only its own sheet, with nothing elsewhere reading it, skips the cross-sheet walk
+#ifdef SPREADSHEET_METRICS
+        std::uint64_t visits = Metrics::Collect().Get(Metrics::Counter::CycleCheckVisits);
+#endif
+        first.SetCell("E1"_pos, "=B2+1");
+#ifdef SPREADSHEET_METRICS
+        ASSERT_EQUAL(Metrics::Collect().Get(Metrics::Counter::CycleCheckVisits), visits);
+#endif
+
+        caught = false;
+        try {
+            book.AddSheet("2nd");
+        }
+        catch (const InvalidSheetNameException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        // a block write or an undo closes a cycle through another sheet just like SetCell
+        Workbook blocks;
+        Sheet& own = blocks.AddSheet("Own");
+        Sheet& other = blocks.AddSheet("Other");
+        own.SetCell("X1"_pos, "=Other!Y1");
+        other.SetCell("Y1"_pos, "=Own!T1");
+        own.SetCell("T2"_pos, "=X2");
+        caught = false;
+        try {
+            own.FillRange("T2"_pos, { 1, 1 }, "T1"_pos, { 1, 1 });
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT(own.GetCell("T1"_pos) == nullptr);
+        caught = false;
+        try {
+            own.CopyRange("T2"_pos, { 1, 1 }, "T1"_pos);
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        other.ClearCell("Y1"_pos);
+        own.SetCell("T1"_pos, "=X1");
+        own.SetCell("T1"_pos, "1");
+        other.SetCell("Y1"_pos, "=Own!T1");
+        caught = false;
+        try {
+            own.Undo();
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(own.GetCell("T1"_pos)->GetText(), "1");
+        ASSERT_EQUAL(own.GetCell("X1"_pos)->GetValue(), CellInterface::Value(1.0));
+
+        Sheet standalone;
+        standalone.SetCell("A1"_pos, "=Sheet1!A1");
+        ASSERT_EQUAL(standalone.GetCell("A1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+    }
+
+    void TestFillRange() {
+        Sheet sheet;
+        for (int i = 0; i < 4; ++i) {
+            sheet.SetCell(Position{ i, 0 }, std::to_string(i + 1));
+        }
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("C1"_pos, "=B1+A1");
+
+#ifdef SPREADSHEET_METRICS
+        std::uint64_t parses = Metrics::Collect().Get(Metrics::Counter::FormulaParses);
+#endif
+        sheet.FillRange("B1"_pos, { 1, 2 }, "B2"_pos, { 3, 2 });
+#ifdef SPREADSHEET_METRICS
+        ASSERT_EQUAL(Metrics::Collect().Get(Metrics::Counter::FormulaParses), parses);
+#endif
+        ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=A3*2");
+        ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetText(), "=B4+A4");
+        ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetValue(), CellInterface::Value(12.0));
+        sheet.SetCell("A4"_pos, "10");
+        ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetValue(), CellInterface::Value(30.0));
+
+        sheet.CopyRange("B1"_pos, { 1, 1 }, "A6"_pos);
+        ASSERT_EQUAL(sheet.GetCell("A6"_pos)->GetText(), "=#REF!*2");
+        ASSERT_EQUAL(sheet.GetCell("A6"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Ref));
+
+        ASSERT(sheet.Undo());
+        ASSERT(sheet.GetCell("A6"_pos) == nullptr);
+        ASSERT(sheet.Undo());
+        ASSERT(sheet.Undo());
+        ASSERT(sheet.GetCell("B3"_pos) == nullptr);
+
+        sheet.SetCell("F1"_pos, "=G1");
+        sheet.SetCell("H1"_pos, "=G1");
+        bool caught = false;
+        try {
+            sheet.CopyRange("F1"_pos, { 1, 1 }, "G1"_pos);
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet.GetCell("G1"_pos)->GetText(), "");
+        sheet.SetCell("G1"_pos, "5");
+        ASSERT_EQUAL(sheet.GetCell("H1"_pos)->GetValue(), CellInterface::Value(5.0));
+    }
+
+    void TestBackgroundRecalculation() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+
+        BackgroundRecalculator recalculator(sheet);
+        recalculator.WaitClean();
+        BackgroundRecalculator::Reading reading = recalculator.GetValue("A2"_pos);
+        ASSERT_EQUAL(reading.value, CellInterface::Value(2.0));
+        ASSERT(!reading.stale);
+
+        sheet.SetCell("A1"_pos, "10");
+        sheet.SetCell("A3"_pos, "=A2*2");
+        recalculator.Submit();
+        std::future<CellInterface::Value> value = recalculator.GetValueWhenClean("A3"_pos);
+        reading = recalculator.GetValue("A2"_pos);
+        ASSERT(reading.stale ? reading.value == CellInterface::Value(2.0) : reading.value == CellInterface::Value(11.0));
+
+        ASSERT_EQUAL(value.get(), CellInterface::Value(22.0));
+        reading = recalculator.GetValue("A3"_pos);
+        ASSERT_EQUAL(reading.value, CellInterface::Value(22.0));
+        ASSERT(!reading.stale);
+    }
+
+    void TestDeltaSubscription() {
+        Sheet sheet;
+        std::vector<SheetDelta> deltas;
+        int subscription = sheet.Subscribe([&deltas](const SheetDelta& delta) { deltas.push_back(delta); });
+        auto changes = [](const SheetDelta& delta) {
+            std::vector<std::pair<Position, CellInterface::Value>> result;
+            for (const CellChange& change : delta.changes) {
+                result.emplace_back(change.pos, change.value);
+            }
+            return result;
+        };
+        using Changes = std::vector<std::pair<Position, CellInterface::Value>>;
+
+        // edits alone evaluate nothing
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1*0");
+        sheet.SetCell("A3"_pos, "=A1+1");
+        ASSERT(deltas.empty());
+        sheet.Recalculate();
+        ASSERT_EQUAL(deltas.size(), 1u);
+        ASSERT(changes(deltas[0]) == (Changes{ { "A1"_pos, 1.0 }, { "A2"_pos, 0.0 }, { "A3"_pos, 2.0 } }));
+
+        // only the values that changed, and nothing when nothing did
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT(!static_cast<const Cell*>(sheet.GetCell("A3"_pos))->GetCashedValue());
+        sheet.Recalculate();
+        ASSERT_EQUAL(deltas.size(), 2u);
+        ASSERT(changes(deltas[1]) == (Changes{ { "A1"_pos, 2.0 }, { "A3"_pos, 3.0 } }));
+        sheet.Recalculate();
+        ASSERT_EQUAL(deltas.size(), 2u);
+
+        sheet.BeginBatch();
+        sheet.SetCell("B1"_pos, "x");
+        sheet.Recalculate();
+        sheet.SetCell("B1"_pos, "y");
+        sheet.ClearCell("A2"_pos);
+        sheet.EndBatch();
+        ASSERT_EQUAL(deltas.size(), 2u);
+        sheet.Recalculate();
+        ASSERT_EQUAL(deltas.size(), 3u);
+        ASSERT(changes(deltas[2]) == (Changes{ { "B1"_pos, "y" }, { "A2"_pos, "" } }));
+
+        // an incremental run reports the cells it evaluated
+        IncrementalRecalculator recalculator(sheet);
+        sheet.SetCell("A1"_pos, "3");
+        ASSERT(recalculator.Run().IsDone());
+        ASSERT_EQUAL(deltas.size(), 4u);
+        ASSERT(changes(deltas[3]) == (Changes{ { "A1"_pos, 3.0 }, { "A3"_pos, 4.0 } }));
+
+        sheet.Unsubscribe(subscription);
+        sheet.SetCell("A1"_pos, "5");
+        sheet.Recalculate();
+        ASSERT_EQUAL(deltas.size(), 4u);
+    }
+
+    void TestRangePrinting() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("C2"_pos, "=A1+1");
+        sheet.SetCell("B40"_pos, "x");
+        sheet.SetCell("Z3"_pos, "far");
+
+        std::ostringstream values;
+        sheet.PrintValues(values, "B1"_pos, { 3, 2 });
+        ASSERT_EQUAL(values.str(), "\t\n\t2\n\t\n");
+
+        std::ostringstream whole;
+        std::ostringstream range;
+        sheet.PrintTexts(whole);
+        sheet.PrintTexts(range, { 0, 0 }, sheet.GetPrintableSize());
+        ASSERT_EQUAL(whole.str(), range.str());
+
+        std::vector<Position> visited;
+        for (auto cursor = sheet.GetCells({ 0, 0 }, { Position::MAX_ROWS, Position::MAX_COLS }); !cursor.Done(); cursor.Next()) {
+            visited.push_back(cursor.GetPosition());
+        }
+        ASSERT(visited == (std::vector<Position>{ "A1"_pos, "C2"_pos, "Z3"_pos, "B40"_pos }));
+
+        auto cursor = sheet.GetCells("B2"_pos, { 100, 100 });
+        sheet.ClearCell("C2"_pos);
+        ASSERT(!cursor.Done() && cursor.GetPosition() == "C2"_pos);
+        ASSERT_EQUAL(cursor.GetText(), "=A1+1");
+        cursor.Next();
+        ASSERT(cursor.GetPosition() == "Z3"_pos);
+
+        // a size past the sheet stops at its edge instead of wrapping around
+        visited.clear();
+        for (auto huge = sheet.GetCells("B2"_pos, { std::numeric_limits<int>::max(), std::numeric_limits<int>::max() }); !huge.Done(); huge.Next()) {
+            visited.push_back(huge.GetPosition());
+        }
+        ASSERT(visited == (std::vector<Position>{ "Z3"_pos, "B40"_pos }));
+        ASSERT(sheet.GetCells("B2"_pos, { -1, 5 }).Done());
+    }
+
+    void TestFormulaCache() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=B1 + 1");
+        sheet.SetCell("A2"_pos, "=B1+1");
+        sheet.SetCell("A3"_pos, "=  B1 +1 ");
+        FormulaCache& cache = sheet.GetFormulaCache();
+        ASSERT_EQUAL(cache.GetMisses(), 1u);
+        ASSERT_EQUAL(cache.GetHits(), 2u);
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=B1+1");
+
+        sheet.SetCell("B1"_pos, "2");
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(3.0));
+
+        // a shift rewrites copies: the cached formula keeps its references
+        sheet.InsertRows(0);
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=B2+1");
+        sheet.SetCell("C1"_pos, "=B1+1");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=B1+1");
+        ASSERT_EQUAL(cache.GetHits(), 3u);
+
+        for (int i = 0; i < 2; ++i) {
+            try {
+                sheet.SetCell("D1"_pos, "=1 2");
+                ASSERT(false);
+            }
+            catch (const FormulaException&) {
+            }
+        }
+        ASSERT_EQUAL(cache.GetSize(), 1u);
+
+        cache.SetCapacity(1);
+        sheet.SetCell("D1"_pos, "=C1*2");
+        ASSERT_EQUAL(cache.GetSize(), 1u);
+        sheet.SetCell("D2"_pos, "=B1+1");
+        ASSERT_EQUAL(cache.GetHits(), 3u);
+    }
+
+    void TestPrecomputedFormula() {
+        auto formula = ParseFormula("(B2 + A1) * A1 + Sheet2!C1");
+        ASSERT_EQUAL(formula->GetExpression(), "(B2+A1)*A1+Sheet2!C1");
+        ASSERT(&formula->GetExpression() == &formula->GetExpression());
+        ASSERT_EQUAL(formula->GetReferencedCells(), (std::vector{"A1"_pos, "B2"_pos}));
+        ASSERT_EQUAL(formula->GetSheetReferences().size(), 1u);
+
+        Sheet sheet;
+        sheet.SetCell("C1"_pos, "=B2+A1");
+        const std::vector<Position>& references = sheet.GetCell("C1"_pos)->GetReferencedCells();
+        ASSERT(&references == &sheet.GetCell("C1"_pos)->GetReferencedCells());
+
+        // a shift recomputes the text and the references of the moved copy
+        sheet.InsertRows(1);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=B3+A1");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetReferencedCells(), (std::vector{"A1"_pos, "B3"_pos}));
+    }
+
+    void TestReferencedEmptyCells() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=Z100+C3*2");
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 1 }));
+        ASSERT(sheet.GetCell("Z100"_pos) != nullptr);
+        ASSERT_EQUAL(sheet.GetCell("Z100"_pos)->GetText(), "");
+        ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), CellInterface::Value(""));
+        ASSERT(sheet.GetCell("B2"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+        sheet.SetCell("C3"_pos, "4");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(8.0));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 3, 3 }));
+
+        // the placeholder goes away with the last reference
+        sheet.SetCell("A1"_pos, "=C3");
+        ASSERT(sheet.GetCell("Z100"_pos) == nullptr);
+        ASSERT(sheet.Undo());
+        ASSERT(sheet.GetCell("Z100"_pos) != nullptr);
+    }
+
+    void TestBatchEvaluation() {
+        const int rows = 40;
+        auto build = [](Sheet& sheet) {
+            for (int i = 0; i < rows; ++i) {
+                sheet.SetCell(Position{ i, 0 }, std::to_string(i * 3 + 1));
+                sheet.SetCell(Position{ i, 1 }, std::to_string(i % 7));
+                sheet.SetCell(Position{ i, 2 }, i == 11 ? "x" : std::to_string(i) + ".5");
+            }
+            sheet.SetCell("A30"_pos, "1e308");
+            sheet.SetCell("C5"_pos, "=1/0");
+            for (int i = 0; i < rows; ++i) {
+                std::string r = std::to_string(i + 1);
+                sheet.SetCell(Position{ i, 3 }, "=A" + r + "/B" + r + "-C" + r + "*-2");
+                sheet.SetCell(Position{ i, 4 }, "=D" + r + "*10+A" + r);
+            }
+        };
+
+        Sheet expected;
+        build(expected);
+
+        for (auto set : { BatchEvaluator::InstructionSet::Scalar, BatchEvaluator::InstructionSet::SSE2, BatchEvaluator::InstructionSet::AVX2 }) {
+            BatchEvaluator::SetInstructionSet(set);
+            Sheet sheet;
+            build(sheet);
+#ifdef SPREADSHEET_METRICS
+            std::uint64_t batched = Metrics::Collect().Get(Metrics::Counter::BatchedEvaluations);
+#endif
+            sheet.Recalculate();
+#ifdef SPREADSHEET_METRICS
+            ASSERT_EQUAL(Metrics::Collect().Get(Metrics::Counter::BatchedEvaluations) - batched, std::uint64_t(2 * rows));
+#endif
+            for (int i = 0; i < rows; ++i) {
+                for (int j = 3; j < 5; ++j) {
+                    ASSERT_EQUAL(sheet.GetCell(Position{ i, j })->GetValue(), expected.GetCell(Position{ i, j })->GetValue());
+                }
+            }
+        }
+        BatchEvaluator::SetInstructionSet(BatchEvaluator::GetBestInstructionSet());
+
+        ASSERT_EQUAL(expected.GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+        ASSERT_EQUAL(expected.GetCell("D12"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+        ASSERT_EQUAL(expected.GetCell("D5"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+        ASSERT_EQUAL(expected.GetCell("E30"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+    }
+
+    void TestLongChains() {
+        const int count = 2000;
+        Sheet sheet;
+        std::string sum = "=A1";
+        std::string canonical = "=A1";
+        double expected = 0.1;
+        sheet.SetCell("A1"_pos, "0.1");
+        for (int i = 2; i <= count; ++i) {
+            double value = 0.1 * (i % 10) + 1e-3 * i;
+            sheet.SetCell(Position{ i - 1, 0 }, std::to_string(value));
+            // summed left to right, as the chain has to
+            expected += std::get<double>(sheet.GetCell(Position{ i - 1, 0 })->GetValue());
+            sum += (i % 3 ? "+A" : "-(-A") + std::to_string(i) + (i % 3 ? "" : ")");
+            canonical += (i % 3 ? "+A" : "--A") + std::to_string(i);
+        }
+        sheet.SetCell("B1"_pos, sum);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), canonical);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(expected));
+
+        auto reformat = [](std::string expr) {
+            return ParseFormula(std::move(expr))->GetExpression();
+        };
+        ASSERT_EQUAL(reformat("(1+2)+3-(4+5)-(6-7)"), "1+2+3-(4+5)-(6-7)");
+        ASSERT_EQUAL(reformat("1/(2*3)*4/5/(6*7)+(1+2)*3"), "1/(2*3)*4/5/(6*7)+(1+2)*3");
+        ASSERT_EQUAL(reformat("1-(2+3)+4"), "1-(2+3)+4");
+
+        // the first failing step decides the error
+        sheet.SetCell("C1"_pos, "text");
+        sheet.SetCell("C2"_pos, "=1/0*1e308*10+C1");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+        sheet.SetCell("C2"_pos, "=C1+1/0");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+        sheet.SetCell("C2"_pos, "=1e308*10/1e300");
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+
+        // chains of any length are fine, nesting too deep for the stack is refused up front
+        auto repeat = [](std::string_view part, int times) {
+            std::string result;
+            for (int i = 0; i < times; ++i) {
+                result += part;
+            }
+            return result;
+        };
+        ASSERT_EQUAL(reformat("1" + repeat("+1", 8000)).size(), 16001u);
+        ASSERT_EQUAL(reformat(repeat("-(", 100) + "1" + repeat(")", 100)), repeat("-", 100) + "1");
+        sheet.SetCell("C4"_pos, "=1" + repeat("+1", 100000));
+        ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetValue(), CellInterface::Value(100001.0));
+        sheet.SetCell("C4"_pos, "=1" + repeat("*2/2", 100000));
+        ASSERT_EQUAL(sheet.GetCell("C4"_pos)->GetValue(), CellInterface::Value(1.0));
+        try {
+            sheet.SetCell("C3"_pos, "=" + repeat("(", 100000) + "1" + repeat(")", 100000));
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+        try {
+            sheet.SetCell("C3"_pos, "=" + repeat("-", 100000) + "1");
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+        ASSERT(sheet.GetCell("C3"_pos) == nullptr);
+    }
+
+    void TestMemoryReport() {
+        Sheet sheet;
+        MemoryReport empty = sheet.GetMemoryReport();
+        ASSERT_EQUAL(empty.graph, 0u);
+        ASSERT_EQUAL(empty.positions, 0u);
+
+        std::string long_text(1000, 'x');
+        for (int i = 0; i < 100; ++i) {
+            sheet.SetCell(Position{ i, 0 }, long_text);
+            sheet.SetCell(Position{ i, 1 }, "=A1+A2*3");
+        }
+        MemoryReport report = sheet.GetMemoryReport();
+        ASSERT(report.texts >= 100 * long_text.size());
+        ASSERT(report.texts < 110 * long_text.size());
+        // one parsed formula shared by a hundred cells
+        ASSERT(report.formulas > 0);
+        ASSERT(report.formulas < 100 * 100);
+        ASSERT_EQUAL(report.positions, 200 * Memory::TreeNode<Position>());
+        using GraphNode = std::pair<const Position, std::set<Position>>;
+        ASSERT_EQUAL(report.graph, (100 + 2) * Memory::TreeNode<GraphNode>() + 2 * 200 * Memory::TreeNode<Position>());
+        ASSERT(report.storage > empty.storage);
+        ASSERT_EQUAL(report.GetTotal(), report.storage + report.values + report.texts + report.formulas + report.graph + report.positions);
+
+        // cashed strings count as values
+        std::size_t values = report.values;
+        sheet.Recalculate();
+        ASSERT(sheet.GetMemoryReport().values >= values + 100 * long_text.size());
+
+        std::ostringstream metrics;
+        sheet.PrintMetrics(metrics);
+        ASSERT(metrics.str().find("spreadsheet_memory_texts_bytes ") != std::string::npos);
+        ASSERT(metrics.str().find("spreadsheet_memory_bytes ") != std::string::npos);
+    }
+
+    void TestWorkloadGenerator() {
+        WorkloadConfig config;
+        config.size = { 60, 8 };
+        config.text_ratio = 0;
+        config.chain_depth = 5;
+        config.error_ratio = 1;
+        config.error_region_rows = 10;
+        config.edits = 30;
+        config.recalculate_every = 10;
+
+        Workload workload = GenerateWorkload(config);
+        ASSERT_EQUAL(workload.setup.size(), size_t(60 * 8));
+        ASSERT_EQUAL(workload.edits.size(), size_t(30 + 3));
+        ASSERT(GenerateWorkload(config).setup == workload.setup);
+        ASSERT(GenerateWorkload(config).edits == workload.edits);
+        config.seed = 2;
+        ASSERT(!(GenerateWorkload(config).setup == workload.setup));
+        config.seed = 1;
+
+        Sheet sheet;
+        Replay(sheet, workload.setup);
+        std::ostringstream tsv, texts;
+        WriteTsv(tsv, workload);
+        sheet.PrintTexts(texts);
+        ASSERT_EQUAL(tsv.str(), texts.str());
+
+        std::map<Position, int> depths;
+        std::function<int(Position)> depth = [&](Position pos) {
+            if (auto it = depths.find(pos); it != depths.end())
+                return it->second;
+            int result = 0;
+            for (const Position& ref : sheet.GetCell(pos)->GetReferencedCells()) {
+                result = std::max(result, depth(ref) + 1);
+            }
+            return depths[pos] = result;
+        };
+        int deepest = 0;
+        for (int row = 0; row < 60; ++row) {
+            for (int col = 0; col < 8; ++col) {
+                Position pos{ row, col };
+                deepest = std::max(deepest, depth(pos));
+                // only the last rows fail, and every formula there does
+                bool is_error = std::holds_alternative<FormulaError>(sheet.GetCell(pos)->GetValue());
+                bool is_formula = sheet.GetCell(pos)->GetText()[0] == '=';
+                ASSERT_EQUAL(is_error, is_formula && row >= 50);
+            }
+        }
+        ASSERT_EQUAL(deepest, 5);
+
+        // edits only rewrite cells, so they replay on top of the setup
+        std::stringstream script;
+        WriteScript(script, workload.edits);
+        ASSERT(ReadScript(script) == workload.edits);
+        Replay(sheet, workload.edits);
+
+        std::istringstream bad("set\tA0\t1\n");
+        try {
+            ReadScript(bad);
+            ASSERT(false);
+        } catch (const InvalidScriptException&) {
+        }
+
+        config.edit_pattern = EditPattern::Root;
+        for (const WorkloadCommand& command : GenerateWorkload(config).edits) {
+            if (command.type == WorkloadCommand::Type::Set) {
+                ASSERT(sheet.GetCell(command.pos)->GetText()[0] != '=');
+            }
+        }
+    }
+
+    void TestAllocationBudgets() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "2");
+        sheet.SetCell("A2"_pos, "=A1*3+1");
+        sheet.SetCell("A3"_pos, "text");
+        sheet.Recalculate();
+
+        const CellInterface* number = sheet.GetCell("A1"_pos);
+        const CellInterface* formula = sheet.GetCell("A2"_pos);
+        ASSERT_EQUAL(std::get<double>(formula->GetValue()), 7.0);
+        ASSERT_ALLOCATIONS(formula->GetValue(), 0u);
+        ASSERT_ALLOCATIONS(number->GetValue(), 0u);
+        ASSERT_ALLOCATIONS(sheet.GetCell("B7"_pos), 0u);
+        ASSERT_ALLOCATIONS(sheet.GetCellValue("A2"_pos), 0u);
+
+        // one parse, the cell and its content, a few graph and journal nodes
+        ASSERT_ALLOCATIONS(sheet.SetCell("B1"_pos, "=A1+A2"), 64u);
+
+        if (Allocations::IsEnabled()) {
+            Allocations::Reset();
+            sheet.SetCell("A1"_pos, "5");
+            sheet.GetCell("B1"_pos)->GetValue();
+
+            auto sites = Allocations::Collect();
+            auto set_cell = std::find_if(sites.begin(), sites.end(), [](const Allocations::SiteStats& site) { return site.name == "Sheet::SetCell"; });
+            ASSERT(set_cell != sites.end());
+            ASSERT_EQUAL(set_cell->calls, 1u);
+            ASSERT(set_cell->total.allocations >= set_cell->self.allocations);
+            ASSERT(set_cell->total.allocations > 0);
+        }
+    }
+
+    void TestLargeSheet() {
+        const int last_row = 1048575;
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell(Position{ last_row, 2 }, "=A1+1");
+        ASSERT_EQUAL(sheet.GetCell("C1048576"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ last_row + 1, 3 }));
+
+        // nothing is sized by the dimensions
+        ASSERT(sheet.GetMemoryReport().GetTotal() < 16 * 1024);
+        int visited = 0;
+        for (auto cursor = sheet.GetCells({ 0, 0 }, { Position::MAX_ROWS, Position::MAX_COLS }); !cursor.Done(); cursor.Next()) {
+            ++visited;
+        }
+        ASSERT_EQUAL(visited, 2);
+        std::ostringstream out;
+        sheet.PrintValues(out, { last_row - 1, 0 }, { 2, 3 });
+        ASSERT_EQUAL(out.str(), "\t\t\n\t\t2\n");
+
+        bool caught = false;
+        try {
+            sheet.InsertRows(0);
+        }
+        catch (const TableTooBigException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+
+        // lower limits at run time; the caps cannot be exceeded
+        Position::SetLimits(16384, 16384);
+        ASSERT(!"A16385"_pos.IsValid());
+        ASSERT("XFD16384"_pos.IsValid());
+        try {
+            Position::SetLimits(Position::MAX_ROWS + 1, 16384);
+            ASSERT(false);
+        }
+        catch (const InvalidPositionException&) {
+        }
+        Position::SetLimits(Position::MAX_ROWS, Position::MAX_COLS);
+        ASSERT("A1048576"_pos.IsValid());
+    }
+
+    void TestBoundedCash() {
+        Sheet sheet, unbounded;
+        std::string long_text(1000, 'x');
+        for (int i = 0; i < 100; ++i) {
+            for (Sheet* s : { &sheet, &unbounded }) {
+                s->SetCell(Position{ i, 0 }, long_text);
+                s->SetCell(Position{ i, 1 }, i ? "=B" + std::to_string(i) + "+1" : "=1");
+            }
+        }
+        sheet.Recalculate();
+        unbounded.Recalculate();
+        ASSERT_EQUAL(sheet.GetCashPool().GetResidentBytes(), 0u);
+
+        // the values cashed before count as soon as there is a budget
+        const std::size_t budget = 10 * (sizeof(CellInterface::Value) + long_text.size());
+        sheet.SetCashBudget(budget);
+        ASSERT(sheet.GetCashPool().GetResidentBytes() <= budget);
+        ASSERT(sheet.GetCashPool().GetEvictions() > 0);
+        ASSERT(sheet.GetMemoryReport().values < unbounded.GetMemoryReport().values / 5);
+
+        // evicted cells are computed again when read
+        ASSERT_EQUAL(sheet.GetCell("B100"_pos)->GetValue(), CellInterface::Value(100.0));
+        ASSERT_EQUAL(sheet.GetCell("A50"_pos)->GetValue(), CellInterface::Value(long_text));
+        std::ostringstream bounded_values, unbounded_values;
+        std::uint64_t read_evictions = sheet.GetCashPool().GetEvictions();
+        sheet.PrintValues(bounded_values);
+        unbounded.PrintValues(unbounded_values);
+        ASSERT(bounded_values.str() == unbounded_values.str());
+
+        // reads never evict, the next edit or recalculation trims to within the slack
+        ASSERT_EQUAL(sheet.GetCashPool().GetEvictions(), read_evictions);
+        sheet.Recalculate();
+        ASSERT(sheet.GetCashPool().GetEvictions() > read_evictions);
+        ASSERT(sheet.GetCashPool().GetResidentBytes() <= budget + budget / 8);
+
+        // reads of cashed values count as hits
+        sheet.GetCell("B100"_pos)->GetValue();
+        ASSERT(sheet.GetCashPool().GetHits() > 0);
+        ASSERT(sheet.GetCashPool().GetMisses() > 0);
+
+        // cells a published snapshot shares keep their cashes
+        sheet.Recalculate();
+        auto snapshot = sheet.Publish();
+        std::uint64_t evictions = sheet.GetCashPool().GetEvictions();
+        sheet.SetCashBudget(budget / 2);
+        ASSERT_EQUAL(sheet.GetCashPool().GetEvictions(), evictions);
+        ASSERT_EQUAL(snapshot->GetCellValue("B100"_pos), CellInterface::Value(100.0));
+
+        std::ostringstream metrics;
+        sheet.PrintMetrics(metrics);
+        ASSERT(metrics.str().find("spreadsheet_cash_resident_bytes ") != std::string::npos);
+        ASSERT(metrics.str().find("spreadsheet_cash_hit_ratio ") != std::string::npos);
+        ASSERT(metrics.str().find("\nspreadsheet_sheet_cash_evicted_cells ") != std::string::npos);
+
+        // the sheets of a workbook are told apart by a label
+        Workbook book;
+        book.AddSheet("Budget").PrintMetrics(metrics);
+        ASSERT(metrics.str().find("\nspreadsheet_cash_budget_bytes{sheet=\"Budget\"} 0\n") != std::string::npos);
+
+        // past the first sweep, the next one waits for another eighth of the budget
+        Sheet slack;
+        for (int i = 0; i < 40; ++i) {
+            slack.SetCell(Position{ i, 0 }, long_text);
+        }
+        slack.SetCashBudget(std::numeric_limits<std::size_t>::max());
+        slack.GetCell("A1"_pos)->GetValue();
+        const std::size_t value = slack.GetCashPool().GetResidentBytes();
+        slack.SetCashBudget(16 * value);
+        std::ostringstream out;
+        slack.PrintValues(out, "A2"_pos, { 16, 1 });
+        ASSERT_EQUAL(slack.GetCashPool().GetEvictions(), 0u);
+        slack.ClearCell("B1"_pos);
+        ASSERT_EQUAL(slack.GetCashPool().GetEvictions(), 1u);
+        slack.PrintValues(out, "A19"_pos, { 2, 1 });
+        slack.ClearCell("B1"_pos);
+        ASSERT_EQUAL(slack.GetCashPool().GetEvictions(), 1u);
+        ASSERT_EQUAL(slack.GetCashPool().GetResidentBytes(), 18 * value);
+        slack.PrintValues(out, "A21"_pos, { 1, 1 });
+        slack.ClearCell("B1"_pos);
+        ASSERT(slack.GetCashPool().GetEvictions() > 1);
+        ASSERT(slack.GetCashPool().GetResidentBytes() <= 16 * value);
+    }
+
+    void TestIncrementalRecalculation() {
+        const int rows = 1000;
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int i = 1; i < rows; ++i) {
+            sheet.SetCell(Position{ i, 0 }, "=A" + std::to_string(i) + "+1");
+        }
+        auto cashed = [&sheet](Position pos) {
+            return static_cast<const Cell*>(sheet.GetCell(pos))->GetCashedValue().has_value();
+        };
+
+        IncrementalRecalculator recalculator(sheet);
+        ASSERT_EQUAL(recalculator.GetRemaining(), std::size_t(rows));
+        IncrementalRecalculator::Progress progress = recalculator.Run({ std::chrono::hours(1), 100 });
+        ASSERT_EQUAL(progress.evaluated, 100u);
+        ASSERT_EQUAL(progress.remaining, std::size_t(rows - 100));
+        // inputs first: the slice is the head of the chain
+        ASSERT(cashed("A100"_pos) && !cashed("A101"_pos));
+
+        // an edit joins the remaining work
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(recalculator.GetRemaining(), std::size_t(rows));
+        // no time left still evaluates one cell
+        progress = recalculator.Run({ std::chrono::nanoseconds(0) });
+        ASSERT_EQUAL(progress.evaluated, 1u);
+        while (!recalculator.Run({ std::chrono::milliseconds(2) }).IsDone()) {
+        }
+        ASSERT(cashed("A1000"_pos));
+        ASSERT_EQUAL(sheet.GetCell("A1000"_pos)->GetValue(), CellInterface::Value(1001.0));
+
+        // moved cells keep their values; deleting the head breaks the whole chain
+        sheet.InsertRows(0);
+        ASSERT_EQUAL(recalculator.GetRemaining(), 0u);
+        sheet.DeleteRows(1);
+        ASSERT_EQUAL(recalculator.GetRemaining(), std::size_t(rows - 1));
+        ASSERT(recalculator.Run().IsDone());
+        ASSERT(cashed("A1000"_pos));
+        ASSERT(std::holds_alternative<FormulaError>(sheet.GetCell("A1000"_pos)->GetValue()));
+    }
+
+    void TestViewportRecalculation() {
+        const int rows = 1000;
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int i = 1; i < rows; ++i) {
+            sheet.SetCell(Position{ i, 0 }, "=A" + std::to_string(i) + "+1");
+        }
+        sheet.SetCell("C1"_pos, "=A20*2");
+        auto cashed = [&sheet](Position pos) {
+            return static_cast<const Cell*>(sheet.GetCell(pos))->GetCashedValue().has_value();
+        };
+
+        IncrementalRecalculator recalculator(sheet);
+        recalculator.Run();
+        sheet.SetCell("A1"_pos, "2");
+
+        // the viewport and the head of the chain it reads come first
+        int viewport = recalculator.AddViewport("C1"_pos, { 1, 1 });
+        IncrementalRecalculator::Progress progress = recalculator.Run({ std::chrono::hours(1), 21 });
+        ASSERT(progress.IsVisibleDone());
+        ASSERT_EQUAL(progress.remaining, std::size_t(rows - 20));
+        ASSERT(cashed("C1"_pos) && !cashed("A21"_pos));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(42.0));
+
+        // moving the viewport plans the rest around it
+        recalculator.RemoveViewport(viewport);
+        recalculator.AddViewport("A990"_pos, { 5, 2 });
+        progress = recalculator.Run({ std::chrono::hours(1), 1 });
+        ASSERT_EQUAL(progress.visible_remaining, std::size_t(994 - 20 - 1));
+        progress = recalculator.Run({ std::chrono::hours(1), 994 - 20 - 1 });
+        ASSERT(progress.IsVisibleDone() && !progress.IsDone());
+        ASSERT(cashed("A994"_pos) && !cashed("A995"_pos));
+
+        ASSERT(recalculator.Run().IsDone());
+        ASSERT_EQUAL(sheet.GetCell("A1000"_pos)->GetValue(), CellInterface::Value(1001.0));
+    }
+
+    void TestBoundedIncrementalRecalculation() {
+        const int rows = 1000;
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int i = 1; i < rows; ++i) {
+            sheet.SetCell(Position{ i, 0 }, "=A" + std::to_string(i) + "+1");
+        }
+        auto cashed = [&sheet](Position pos) {
+            return static_cast<const Cell*>(sheet.GetCell(pos))->GetCashedValue().has_value();
+        };
+        // a slice evaluates its own cells only: nothing recurses down the chain
+        auto run_slices = [&sheet](IncrementalRecalculator& recalculator) {
+            IncrementalRecalculator::Progress progress;
+            do {
+#ifdef SPREADSHEET_METRICS
+                std::uint64_t before = Metrics::Collect().Get(Metrics::Counter::Evaluations);
+                progress = recalculator.Run({ std::chrono::hours(1), 50 });
+                ASSERT(Metrics::Collect().Get(Metrics::Counter::Evaluations) - before <= 50);
+#else
+                progress = recalculator.Run({ std::chrono::hours(1), 50 });
+#endif
+            } while (!progress.IsDone());
+            return progress;
+        };
+
+        IncrementalRecalculator recalculator(sheet);
+        recalculator.AddViewport("A1000"_pos, { 1, 1 });
+        sheet.SetCashBudget(20 * sizeof(CellInterface::Value));
+
+        // the cells of the plan keep their values until it is done
+        IncrementalRecalculator::Progress progress = recalculator.Run({ std::chrono::hours(1), 500 });
+        ASSERT_EQUAL(sheet.GetCashPool().GetEvictions(), 0u);
+        ASSERT(cashed("A1"_pos) && cashed("A500"_pos));
+        progress = run_slices(recalculator);
+        ASSERT(progress.IsVisibleDone());
+        ASSERT(sheet.GetCashPool().GetEvictions() > 0);
+        ASSERT(!cashed("A500"_pos) && cashed("A1000"_pos));
+        ASSERT_EQUAL(recalculator.GetRemaining(), 0u);
+
+        // a new reader of the evicted chain plans the chain before itself
+        sheet.SetCell("B1"_pos, "=A500*2");
+        ASSERT(recalculator.GetRemaining() > 100);
+        run_slices(recalculator);
+        ASSERT(cashed("B1"_pos));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(1000.0));
+    }
+
+    void TestParallelParsing() {
+        const int threads = 4;
+        const int formulas = 200;
+        std::vector<std::vector<std::string>> expressions(threads);
+
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            workers.emplace_back([t, &expressions] {
+                for (int i = 0; i < formulas; ++i) {
+                    std::string text = "=A" + std::to_string(i + 1) + "*" + std::to_string(t) + "+(B1)";
+                    // a failed parse leaves the thread's parser ready for the next formula
+                    try {
+                        ParseFormula("1+*" + std::to_string(i));
+                        expressions[t].push_back("no error");
+                    }
+                    catch (const FormulaException&) {
+                    }
+                    expressions[t].push_back(ParseFormula(std::string_view(text).substr(1))->GetExpression());
+                }
+            });
+        }
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+
+        for (int t = 0; t < threads; ++t) {
+            ASSERT_EQUAL(expressions[t].size(), size_t(formulas));
+            ASSERT_EQUAL(expressions[t][9], "A10*" + std::to_string(t) + "+B1");
+        }
+    }
 }  // namespace
 
 std::unique_ptr<SheetInterface> CreateSheetWithCells(int n = 50, int offset = 0) {
@@ -409,6 +1551,31 @@ int main() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestSnapshotIsolation);
+    RUN_TEST(tr, TestConcurrentSnapshotReaders);
+    RUN_TEST(tr, TestUndoRedo);
+    RUN_TEST(tr, TestMetrics);
+    RUN_TEST(tr, TestHotCells);
+    RUN_TEST(tr, TestInsertDeleteRowsCols);
+    RUN_TEST(tr, TestWorkbook);
+    RUN_TEST(tr, TestFillRange);
+    RUN_TEST(tr, TestBackgroundRecalculation);
+    RUN_TEST(tr, TestDeltaSubscription);
+    RUN_TEST(tr, TestRangePrinting);
+    RUN_TEST(tr, TestFormulaCache);
+    RUN_TEST(tr, TestPrecomputedFormula);
+    RUN_TEST(tr, TestReferencedEmptyCells);
+    RUN_TEST(tr, TestBatchEvaluation);
+    RUN_TEST(tr, TestLongChains);
+    RUN_TEST(tr, TestMemoryReport);
+    RUN_TEST(tr, TestWorkloadGenerator);
+    RUN_TEST(tr, TestAllocationBudgets);
+    RUN_TEST(tr, TestLargeSheet);
+    RUN_TEST(tr, TestBoundedCash);
+    RUN_TEST(tr, TestIncrementalRecalculation);
+    RUN_TEST(tr, TestViewportRecalculation);
+    RUN_TEST(tr, TestBoundedIncrementalRecalculation);
+    RUN_TEST(tr, TestParallelParsing);
 
     cout << endl << endl;
 
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Type-aware estimates of the heap memory standard containers hold, for the
+// memory report of a sheet (see Sheet::GetMemoryReport). Node sizes follow
+// the usual layouts: a tree node carries its color and three links, a
+// forward_list node one link, and make_shared puts the two reference counts
+// and a vtable pointer in front of the object. Allocator overhead is not
+// counted.
+namespace Memory
+{
+    static const std::size_t TREE_NODE_LINKS = 4 * sizeof(void*);
+    static const std::size_t SHARED_CONTROL_BLOCK = sizeof(void*) + 2 * sizeof(int);
+
+    // A node of std::set<T> or of std::map with value_type T
+    template <typename T>
+    constexpr std::size_t TreeNode()
+    {
+        return TREE_NODE_LINKS + sizeof(T);
+    }
+    template <typename T>
+    constexpr std::size_t ListNode()
+    {
+        return sizeof(void*) + sizeof(T);
+    }
+    // The single allocation of std::make_shared<T>
+    template <typename T>
+    constexpr std::size_t Shared()
+    {
+        return SHARED_CONTROL_BLOCK + sizeof(T);
+    }
+
+    // Short strings live inside the object and take no heap
+    inline std::size_t Heap(const std::string& str)
+    {
+        const char* data = str.data();
+        const char* object = reinterpret_cast<const char*>(&str);
+        if (data >= object && data < object + sizeof(str))
+            return 0;
+
+        return str.capacity() + 1;
+    }
+    template <typename T>
+    std::size_t Heap(const std::vector<T>& vec)
+    {
+        return vec.capacity() * sizeof(T);
+    }
+}
@@ -0,0 +1,194 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <mutex>
+
+namespace Metrics
+{
+    namespace
+    {
+        struct CounterInfo
+        {
+            const char* name;
+            const char* help;
+        };
+        const CounterInfo COUNTER_INFO[COUNTERS] =
+        {
+            {"spreadsheet_formula_parses_total", "Formulas parsed"},
+            {"spreadsheet_cash_hits_total", "Cell::GetValue calls answered from the cash"},
+            {"spreadsheet_cash_misses_total", "Cell::GetValue calls that had to compute the value"},
+            {"spreadsheet_evaluations_total", "Formula evaluations"},
+            {"spreadsheet_cells_invalidated_total", "Cell cashes cleared by edits"},
+            {"spreadsheet_cycle_check_visits_total", "Dependent cells visited by cycle checks"},
+            {"spreadsheet_formula_cache_hits_total", "Formula texts found in the parse cache"},
+            {"spreadsheet_formula_cache_misses_total", "Formula texts that had to be parsed"},
+            {"spreadsheet_batched_evaluations_total", "Formula cells evaluated together with others of the same shape"},
+            {"spreadsheet_cash_evictions_total", "Cashes dropped to keep a sheet within its cash budget"},
+        };
+
+        struct HistogramInfo
+        {
+            const char* name;
+            const char* help;
+            double scale;  // multiplier from recorded units to exported units
+            std::array<std::uint64_t, MAX_BUCKETS> bounds;
+        };
+        const HistogramInfo HISTOGRAM_INFO[HISTOGRAMS] =
+        {
+            {"spreadsheet_formula_parse_seconds", "Time spent parsing one formula", 1e-9,
+             {1000, 4000, 16000, 64000, 256000, 1024000, 4096000, 16384000, 65536000, 262144000, 1048576000, 4194304000}},
+            {"spreadsheet_cells_invalidated_per_edit", "Cell cashes cleared by one edit", 1,
+             {0, 1, 4, 16, 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576}},
+        };
+
+        // written only by the owning thread, read by Collect() from any thread
+        struct ThreadData
+        {
+            std::array<std::atomic<std::uint64_t>, COUNTERS> counters{};
+            std::array<std::array<std::atomic<std::uint64_t>, MAX_BUCKETS + 1>, HISTOGRAMS> buckets{};
+            std::array<std::atomic<std::uint64_t>, HISTOGRAMS> sums{};
+            std::array<std::atomic<std::uint64_t>, HISTOGRAMS> counts{};
+        };
+
+        void Bump(std::atomic<std::uint64_t>& value, std::uint64_t n)
+        {
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        void AddTo(Snapshot& snapshot, const ThreadData& data)
+        {
+            for (int i = 0; i < COUNTERS; ++i)
+            {
+                snapshot.counters[i] += data.counters[i].load(std::memory_order_relaxed);
+            }
+            for (int i = 0; i < HISTOGRAMS; ++i)
+            {
+                HistogramData& histogram = snapshot.histograms[i];
+                for (int b = 0; b <= MAX_BUCKETS; ++b)
+                {
+                    histogram.buckets[b] += data.buckets[i][b].load(std::memory_order_relaxed);
+                }
+                histogram.sum += data.sums[i].load(std::memory_order_relaxed);
+                histogram.count += data.counts[i].load(std::memory_order_relaxed);
+            }
+        }
+
+        struct Registry
+        {
+            std::mutex mutex;
+            std::vector<const ThreadData*> live;
+            Snapshot retired;  // what exited threads had recorded
+        };
+        Registry& GetRegistry()
+        {
+            // never destroyed: threads may still retire their data during static destruction
+            static Registry* registry = new Registry();
+            return *registry;
+        }
+
+        struct ThreadSlot
+        {
+            ThreadSlot()
+            {
+                Registry& registry = GetRegistry();
+                std::lock_guard guard(registry.mutex);
+                registry.live.push_back(&data);
+            }
+            ~ThreadSlot()
+            {
+                Registry& registry = GetRegistry();
+                std::lock_guard guard(registry.mutex);
+                AddTo(registry.retired, data);
+                registry.live.erase(std::find(registry.live.begin(), registry.live.end(), &data));
+            }
+
+            ThreadData data;
+        };
+        ThreadData& Local()
+        {
+            thread_local ThreadSlot slot;
+            return slot.data;
+        }
+    }
+
+    std::uint64_t Snapshot::Get(Counter counter) const
+    {
+        return counters[static_cast<int>(counter)];
+    }
+    const HistogramData& Snapshot::Get(Histogram histogram) const
+    {
+        return histograms[static_cast<int>(histogram)];
+    }
+
+    void Add(Counter counter, std::uint64_t n)
+    {
+        Bump(Local().counters[static_cast<int>(counter)], n);
+    }
+    void Observe(Histogram histogram, std::uint64_t value)
+    {
+        int index = static_cast<int>(histogram);
+        const auto& bounds = HISTOGRAM_INFO[index].bounds;
+        ThreadData& data = Local();
+
+        int bucket = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+        Bump(data.buckets[index][bucket], 1);
+        Bump(data.sums[index], value);
+        Bump(data.counts[index], 1);
+    }
+
+    Snapshot Collect()
+    {
+        Registry& registry = GetRegistry();
+        std::lock_guard guard(registry.mutex);
+
+        Snapshot result = registry.retired;
+        for (const ThreadData* data : registry.live)
+        {
+            AddTo(result, *data);
+        }
+
+        return result;
+    }
+
+    void WritePrometheus(std::ostream& output, const Snapshot& snapshot, const std::vector<Gauge>& gauges)
+    {
+        for (int i = 0; i < COUNTERS; ++i)
+        {
+            const CounterInfo& info = COUNTER_INFO[i];
+            output << "# HELP " << info.name << ' ' << info.help << '\n';
+            output << "# TYPE " << info.name << " counter\n";
+            output << info.name << ' ' << snapshot.counters[i] << '\n';
+        }
+
+        for (int i = 0; i < HISTOGRAMS; ++i)
+        {
+            const HistogramInfo& info = HISTOGRAM_INFO[i];
+            const HistogramData& histogram = snapshot.histograms[i];
+            output << "# HELP " << info.name << ' ' << info.help << '\n';
+            output << "# TYPE " << info.name << " histogram\n";
+
+            std::uint64_t cumulative = 0;
+            for (int b = 0; b < MAX_BUCKETS; ++b)
+            {
+                cumulative += histogram.buckets[b];
+                output << info.name << "_bucket{le=\"" << info.bounds[b] * info.scale << "\"} " << cumulative << '\n';
+            }
+            cumulative += histogram.buckets[MAX_BUCKETS];
+            output << info.name << "_bucket{le=\"+Inf\"} " << cumulative << '\n';
+            output << info.name << "_sum " << histogram.sum * info.scale << '\n';
+            output << info.name << "_count " << histogram.count << '\n';
+        }
+
+        for (const Gauge& gauge : gauges)
+        {
+            output << "# HELP " << gauge.name << ' ' << gauge.help << '\n';
+            output << "# TYPE " << gauge.name << " gauge\n";
+            output << gauge.name;
+            if (!gauge.labels.empty())
+                output << '{' << gauge.labels << '}';
+            output << ' ' << gauge.value << '\n';
+        }
+    }
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Engine-wide counters and histograms. Every thread bumps its own copy, so
+// recording is a couple of uncontended stores; Collect() sums all threads.
+// Call sites go through the SPREADSHEET_METRIC_* macros, which compile to
+// nothing unless SPREADSHEET_METRICS is defined.
+namespace Metrics
+{
+    enum class Counter
+    {
+        FormulaParses,
+        CashHits,
+        CashMisses,
+        Evaluations,
+        CellsInvalidated,
+        CycleCheckVisits,
+        FormulaCacheHits,
+        FormulaCacheMisses,
+        BatchedEvaluations,
+        CashEvictions,
+        COUNT,
+    };
+
+    enum class Histogram
+    {
+        ParseNanoseconds,
+        InvalidatedPerEdit,
+        COUNT,
+    };
+
+    static const int COUNTERS = static_cast<int>(Counter::COUNT);
+    static const int HISTOGRAMS = static_cast<int>(Histogram::COUNT);
+    static const int MAX_BUCKETS = 12;
+
+    struct HistogramData
+    {
+        std::array<std::uint64_t, MAX_BUCKETS + 1> buckets{};  // the last one is +Inf
+        std::uint64_t sum = 0;
+        std::uint64_t count = 0;
+    };
+
+    struct Snapshot
+    {
+        std::array<std::uint64_t, COUNTERS> counters{};
+        std::array<HistogramData, HISTOGRAMS> histograms{};
+
+        std::uint64_t Get(Counter counter) const;
+        const HistogramData& Get(Histogram histogram) const;
+    };
+
+    struct Gauge
+    {
+        std::string name;
+        std::string help;
+        double value;
+        std::string labels = {};  // name="value" pairs joined by commas, if any
+    };
+
+    void Add(Counter counter, std::uint64_t n = 1);
+    void Observe(Histogram histogram, std::uint64_t value);
+
+    Snapshot Collect();
+    // Prometheus text exposition format; gauges are appended as they are
+    void WritePrometheus(std::ostream& output, const Snapshot& snapshot, const std::vector<Gauge>& gauges = {});
+
+    class ScopedTimer
+    {
+    public:
+        explicit ScopedTimer(Histogram histogram) : histogram(histogram), start(std::chrono::steady_clock::now()) {}
+        ~ScopedTimer()
+        {
+            Observe(histogram, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        }
+
+    private:
+        Histogram histogram;
+        std::chrono::steady_clock::time_point start;
+    };
+}
+
+#ifdef SPREADSHEET_METRICS
+#define SPREADSHEET_METRIC_ADD(counter, n) ::Metrics::Add(::Metrics::Counter::counter, (n))
+#define SPREADSHEET_METRIC_OBSERVE(histogram, value) ::Metrics::Observe(::Metrics::Histogram::histogram, (value))
+#define SPREADSHEET_METRIC_TIMER(histogram) ::Metrics::ScopedTimer metric_timer_##histogram(::Metrics::Histogram::histogram)
+#else
+#define SPREADSHEET_METRIC_ADD(counter, n) ((void)0)
+#define SPREADSHEET_METRIC_OBSERVE(histogram, value) ((void)0)
+#define SPREADSHEET_METRIC_TIMER(histogram) ((void)0)
+#endif
@@ -0,0 +1,81 @@
+#include "profiler.h"
+
+#include <cstddef>
+#include <functional>
+
+namespace
+{
+    thread_local EvaluationProfiler::Scope* current_scope = nullptr;
+}
+
+EvaluationProfiler::Scope::Scope(EvaluationProfiler& profiler, const Cell* cell) : profiler(profiler), cell(cell), start(std::chrono::steady_clock::now()), parent(current_scope)
+{
+    current_scope = this;
+}
+EvaluationProfiler::Scope::~Scope()
+{
+    auto total = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+    current_scope = parent;
+    if (parent)
+        parent->children_time += total;
+
+    Shard& shard = profiler.ShardOf(cell);
+    std::lock_guard guard(shard.mutex);
+    CellStats& stats = shard.stats[cell];
+    ++stats.evaluations;
+    stats.total_time += total;
+    stats.self_time += total - children_time;
+}
+
+void EvaluationProfiler::RecordInvalidation(const Cell* cell)
+{
+    Shard& shard = ShardOf(cell);
+    std::lock_guard guard(shard.mutex);
+    ++shard.stats[cell].invalidations;
+}
+void EvaluationProfiler::Rename(const Cell* from, const Cell* to)
+{
+    CellStats moved;
+    {
+        Shard& shard = ShardOf(from);
+        std::lock_guard guard(shard.mutex);
+        auto it = shard.stats.find(from);
+        if (it == shard.stats.end())
+            return;
+        moved = it->second;
+        shard.stats.erase(it);
+    }
+
+    Shard& shard = ShardOf(to);
+    std::lock_guard guard(shard.mutex);
+    CellStats& stats = shard.stats[to];
+    stats.evaluations += moved.evaluations;
+    stats.invalidations += moved.invalidations;
+    stats.total_time += moved.total_time;
+    stats.self_time += moved.self_time;
+}
+void EvaluationProfiler::Forget(const Cell* cell)
+{
+    Shard& shard = ShardOf(cell);
+    std::lock_guard guard(shard.mutex);
+    shard.stats.erase(cell);
+}
+
+std::unordered_map<const Cell*, EvaluationProfiler::CellStats> EvaluationProfiler::GetStats() const
+{
+    std::unordered_map<const Cell*, CellStats> result;
+
+    for (const Shard& shard : shards)
+    {
+        std::lock_guard guard(shard.mutex);
+        result.insert(shard.stats.begin(), shard.stats.end());
+    }
+
+    return result;
+}
+
+EvaluationProfiler::Shard& EvaluationProfiler::ShardOf(const Cell* cell)
+{
+    return shards[std::hash<const Cell*>()(cell) / alignof(std::max_align_t) % SHARDS];
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+class Cell;
+
+// Per-cell evaluation statistics, collected while profiling is enabled on a
+// sheet. Cells are keyed by address; the sheet maps them back to positions
+// when it builds a report. The table is split into shards so that readers on
+// different threads rarely meet on the same mutex.
+class EvaluationProfiler
+{
+public:
+    struct CellStats
+    {
+        std::uint64_t evaluations = 0;
+        std::uint64_t invalidations = 0;
+        std::chrono::nanoseconds total_time{0};
+        std::chrono::nanoseconds self_time{0};  // total minus the evaluations of referenced cells
+    };
+
+    // Times one evaluation of a cell; nested scopes on the same thread are
+    // subtracted from the self time of the enclosing one
+    class Scope
+    {
+    public:
+        Scope(EvaluationProfiler& profiler, const Cell* cell);
+        ~Scope();
+
+    private:
+        EvaluationProfiler& profiler;
+        const Cell* cell;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::nanoseconds children_time{0};
+        Scope* parent;
+    };
+
+    void RecordInvalidation(const Cell* cell);
+    // The sheet swapped a cell for its copy (see CellStorage::GetForWrite)
+    void Rename(const Cell* from, const Cell* to);
+    // The sheet replaced the cell: its address may be reused by an unrelated one
+    void Forget(const Cell* cell);
+
+    std::unordered_map<const Cell*, CellStats> GetStats() const;
+
+private:
+    static const int SHARDS = 16;
+
+    struct Shard
+    {
+        mutable std::mutex mutex;
+        std::unordered_map<const Cell*, CellStats> stats;
+    };
+
+    Shard& ShardOf(const Cell* cell);
+
+    std::array<Shard, SHARDS> shards;
+};
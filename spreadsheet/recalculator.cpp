@@ -0,0 +1,331 @@
+#include "recalculator.h"
+
+#include "cell.h"
+
+#include <atomic>
+#include <deque>
+#include <map>
+
+BackgroundRecalculator::BackgroundRecalculator(Sheet& sheet) : sheet(sheet)
+{
+    Submit();
+    worker = std::thread([this] { Run(); });
+}
+BackgroundRecalculator::~BackgroundRecalculator()
+{
+    {
+        std::lock_guard guard(mutex);
+        stopping = true;
+    }
+    work_ready.notify_one();
+    worker.join();
+}
+
+void BackgroundRecalculator::Submit()
+{
+    std::shared_ptr<const SheetSnapshot> snapshot = sheet.Publish();
+
+    {
+        std::lock_guard guard(mutex);
+        pending = std::move(snapshot);
+        submitted_version = pending->GetVersion();
+    }
+    work_ready.notify_one();
+}
+
+BackgroundRecalculator::Reading BackgroundRecalculator::GetValue(Position pos) const
+{
+    std::shared_ptr<const SheetSnapshot> snapshot = GetCleanSnapshot();
+
+    if (!snapshot)
+        return {"", true};
+
+    bool stale;
+    {
+        std::lock_guard guard(mutex);
+        stale = snapshot->GetVersion() < submitted_version;
+    }
+
+    // the worker has evaluated every cell already: this only reads cashes
+    return {snapshot->GetCellValue(pos), stale};
+}
+std::future<CellInterface::Value> BackgroundRecalculator::GetValueWhenClean(Position pos)
+{
+    std::lock_guard guard(mutex);
+    std::promise<CellInterface::Value> promise;
+    std::future<CellInterface::Value> result = promise.get_future();
+
+    if (IsClean())
+        promise.set_value(clean->GetCellValue(pos));
+    else
+        waiters.push_back({pos, submitted_version, std::move(promise)});
+
+    return result;
+}
+void BackgroundRecalculator::WaitClean() const
+{
+    std::unique_lock lock(mutex);
+    clean_ready.wait(lock, [this] { return IsClean(); });
+}
+
+std::shared_ptr<const SheetSnapshot> BackgroundRecalculator::GetCleanSnapshot() const
+{
+    return std::atomic_load(&clean);
+}
+
+void BackgroundRecalculator::Run()
+{
+    std::unique_lock lock(mutex);
+
+    while (true)
+    {
+        work_ready.wait(lock, [this] { return stopping || pending; });
+        if (stopping)
+            return;
+
+        std::shared_ptr<const SheetSnapshot> snapshot = std::move(pending);
+        pending.reset();
+
+        lock.unlock();
+        snapshot->Recalculate();
+        lock.lock();
+
+        std::atomic_store(&clean, snapshot);
+
+        auto it = waiters.begin();
+        while (it != waiters.end())
+        {
+            if (it->version <= snapshot->GetVersion())
+            {
+                it->promise.set_value(snapshot->GetCellValue(it->pos));
+                it = waiters.erase(it);
+            }
+            else
+                ++it;
+        }
+        clean_ready.notify_all();
+    }
+}
+
+bool BackgroundRecalculator::IsClean() const
+{
+    return clean && clean->GetVersion() >= submitted_version;
+}
+
+bool IncrementalRecalculator::Progress::IsDone() const
+{
+    return remaining == 0;
+}
+bool IncrementalRecalculator::Progress::IsVisibleDone() const
+{
+    return visible_remaining == 0;
+}
+
+IncrementalRecalculator::IncrementalRecalculator(Sheet& sheet) : sheet(sheet)
+{
+    sheet.incremental = this;
+    MarkAllDirty();
+}
+IncrementalRecalculator::~IncrementalRecalculator()
+{
+    sheet.incremental = nullptr;
+}
+
+IncrementalRecalculator::Progress IncrementalRecalculator::Run(const Budget& budget)
+{
+    if (!dirty.empty() || replan)
+        Plan();
+
+    Progress progress;
+    auto start = std::chrono::steady_clock::now();
+
+    while (next < order.size() && progress.evaluated < budget.cells)
+    {
+        if (progress.evaluated > 0 && std::chrono::steady_clock::now() - start >= budget.time)
+            break;
+
+        // a cell cleared since the plan was made has nothing to evaluate
+        if (const Cell* cell = sheet.storage.Get(order[next]))
+            sheet.NoteValue(order[next], cell->GetValue());
+
+        ++next;
+        ++progress.evaluated;
+    }
+
+    if (next == order.size())
+    {
+        order.clear();
+        visible_end = 0;
+        next = 0;
+        pinned.clear();
+    }
+    progress.remaining = order.size() - next;
+    progress.visible_remaining = next < visible_end ? visible_end - next : 0;
+
+    sheet.TrimCash();
+    sheet.DeliverDelta();
+    return progress;
+}
+IncrementalRecalculator::Progress IncrementalRecalculator::Run()
+{
+    return Run(Budget{});
+}
+std::size_t IncrementalRecalculator::GetRemaining()
+{
+    if (!dirty.empty() || replan)
+        Plan();
+
+    return order.size() - next;
+}
+
+int IncrementalRecalculator::AddViewport(Position first, Size size)
+{
+    viewports.emplace(next_viewport, Viewport{first, size});
+    replan = true;
+    return next_viewport++;
+}
+void IncrementalRecalculator::RemoveViewport(int viewport)
+{
+    replan = viewports.erase(viewport) > 0 || replan;
+}
+
+void IncrementalRecalculator::MarkDirty(Position pos)
+{
+    dirty.insert(pos);
+}
+void IncrementalRecalculator::MarkAllDirty()
+{
+    dirty.clear();
+    order.clear();
+    visible_end = 0;
+    next = 0;
+    pinned.clear();
+
+    for (const Position& pos : sheet.positions)
+    {
+        if (!sheet.storage.Get(pos)->GetCashedValue())
+            dirty.insert(dirty.end(), pos);
+    }
+}
+
+void IncrementalRecalculator::Plan()
+{
+    dirty.insert(order.begin() + next, order.end());
+    order.clear();
+    next = 0;
+
+    // the dirty cells, the visible cells the bounded cash evicted, and any
+    // input of theirs it evicted as well: a cell evaluated before its input
+    // would compute the input and everything behind it recursively
+    std::map<Position, std::size_t> waiting;
+    std::vector<Position> stack;
+    auto plan = [this, &waiting, &stack](Position pos)
+    {
+        const Cell* cell = sheet.storage.Get(pos);
+        if (cell && !cell->GetCashedValue() && waiting.emplace(pos, 0).second)
+            stack.push_back(pos);
+    };
+    for (const Position& pos : dirty)
+    {
+        plan(pos);
+    }
+    for (const auto& [id, viewport] : viewports)
+    {
+        for (CellCursor cursor = sheet.GetCells(viewport.first, viewport.size); !cursor.Done(); cursor.Next())
+        {
+            plan(cursor.GetPosition());
+        }
+    }
+    while (!stack.empty())
+    {
+        Position pos = stack.back();
+        stack.pop_back();
+
+        for (const Position& ref : sheet.storage.Get(pos)->GetReferencedCells())
+        {
+            plan(ref);
+        }
+    }
+
+    // the planned references of every planned cell; until the plan is done
+    // the cash keeps what the planned cells read
+    pinned.clear();
+    for (auto& [pos, count] : waiting)
+    {
+        pinned.insert(pos);
+        for (const Position& ref : sheet.storage.Get(pos)->GetReferencedCells())
+        {
+            count += waiting.count(ref);
+            pinned.insert(ref);
+        }
+    }
+
+    // the planned cells in the viewports and the planned cells they read;
+    // a cashed cell in between already has the value they need
+    std::set<Position> visible;
+    for (const auto& [id, viewport] : viewports)
+    {
+        for (CellCursor cursor = sheet.GetCells(viewport.first, viewport.size); !cursor.Done(); cursor.Next())
+        {
+            if (waiting.count(cursor.GetPosition()) && visible.insert(cursor.GetPosition()).second)
+                stack.push_back(cursor.GetPosition());
+        }
+    }
+    while (!stack.empty())
+    {
+        Position pos = stack.back();
+        stack.pop_back();
+
+        for (const Position& ref : sheet.storage.Get(pos)->GetReferencedCells())
+        {
+            if (waiting.count(ref) && visible.insert(ref).second)
+                stack.push_back(ref);
+        }
+    }
+
+    // a cell is ready once the last of its planned references is planned;
+    // the visible cells only wait for each other, so they all come first
+    std::deque<Position> ready[2];
+    auto make_ready = [&ready, &visible](Position pos)
+    {
+        ready[visible.count(pos) ? 0 : 1].push_back(pos);
+    };
+
+    for (const auto& [pos, count] : waiting)
+    {
+        if (count == 0)
+            make_ready(pos);
+    }
+    while (!ready[0].empty() || !ready[1].empty())
+    {
+        std::deque<Position>& queue = ready[0].empty() ? ready[1] : ready[0];
+        order.push_back(queue.front());
+        queue.pop_front();
+
+        for (const Position& dependent : sheet.graph.GetDependents(order.back()))
+        {
+            auto it = waiting.find(dependent);
+            if (it != waiting.end() && --it->second == 0)
+                make_ready(dependent);
+        }
+    }
+
+    visible_end = visible.size();
+    dirty.clear();
+    replan = false;
+    if (order.empty())
+        pinned.clear();
+}
+bool IncrementalRecalculator::IsPinned(Position pos) const
+{
+    if (pinned.count(pos))
+        return true;
+
+    for (const auto& [id, viewport] : viewports)
+    {
+        if (pos.row >= viewport.first.row && pos.row - viewport.first.row < viewport.size.rows
+            && pos.col >= viewport.first.col && pos.col - viewport.first.col < viewport.size.cols)
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+// Takes recalculation off the editing thread. The writer edits the sheet as
+// usual and calls Submit(), which publishes a snapshot and returns at once; a
+// worker thread then evaluates every cell of that snapshot. Readers get the
+// values of the last snapshot the worker finished, or wait for a newer one,
+// and never evaluate anything themselves.
+class BackgroundRecalculator
+{
+public:
+    struct Reading
+    {
+        CellInterface::Value value;
+        bool stale;  // a later Submit() is not recalculated yet
+    };
+
+    // Submits the current state of the sheet
+    explicit BackgroundRecalculator(Sheet& sheet);
+    ~BackgroundRecalculator();
+
+    // Writer side; a newer submission replaces one the worker has not started
+    void Submit();
+
+    // Reader side, safe to call from any thread. Until the first
+    // recalculation finishes every value is empty and stale.
+    Reading GetValue(Position pos) const;
+    // Resolves once everything submitted so far is recalculated
+    std::future<CellInterface::Value> GetValueWhenClean(Position pos);
+    void WaitClean() const;
+
+    // The last snapshot with every value computed
+    std::shared_ptr<const SheetSnapshot> GetCleanSnapshot() const;
+
+private:
+    struct Waiter
+    {
+        Position pos;
+        std::uint64_t version;
+        std::promise<CellInterface::Value> promise;
+    };
+
+    void Run();
+    bool IsClean() const;
+
+    Sheet& sheet;
+
+    mutable std::mutex mutex;
+    std::condition_variable work_ready;
+    mutable std::condition_variable clean_ready;
+    std::shared_ptr<const SheetSnapshot> pending;
+    std::uint64_t submitted_version = 0;
+    std::vector<Waiter> waiters;
+    bool stopping = false;
+
+    std::shared_ptr<const SheetSnapshot> clean;
+
+    std::thread worker;
+};
+
+// Recalculates a sheet a slice at a time on the editing thread. Each Run()
+// evaluates the cells that edits left without a value, the inputs of a cell
+// before the cell, until the budget runs out, and the next call resumes where
+// it stopped. Cells invalidated in between join the remaining work. Every cell
+// finds its inputs cashed, so a slice never recurses down a long chain and
+// its cost follows the number of cells. Cells in a registered viewport, and
+// the planned cells they read, directly or not, go first: the visible part of
+// the sheet is consistent after a few runs, and later ones drain the rest.
+// A bounded cash does not evict the cells of an unfinished plan, their
+// inputs or the cells of a viewport, and the plan takes in the inputs it
+// evicted before. One per sheet; it must not outlive it.
+class IncrementalRecalculator
+{
+public:
+    // Whichever runs out first; no time left still lets a run evaluate one cell
+    struct Budget
+    {
+        std::chrono::steady_clock::duration time = std::chrono::steady_clock::duration::max();
+        std::size_t cells = std::numeric_limits<std::size_t>::max();
+    };
+    struct Progress
+    {
+        std::size_t evaluated = 0;  // by this run
+        std::size_t remaining = 0;  // for the next ones
+        std::size_t visible_remaining = 0;  // of them, the ones the viewports need
+
+        bool IsDone() const;
+        bool IsVisibleDone() const;
+    };
+
+    // Starts with every cell that has no value yet
+    explicit IncrementalRecalculator(Sheet& sheet);
+    ~IncrementalRecalculator();
+
+    IncrementalRecalculator(const IncrementalRecalculator&) = delete;
+    IncrementalRecalculator& operator=(const IncrementalRecalculator&) = delete;
+
+    Progress Run(const Budget& budget);
+    // Until the work is done
+    Progress Run();
+    // Plans the cells invalidated since the last run first
+    std::size_t GetRemaining();
+
+    // A rectangle the user sees; the next run plans again around it
+    int AddViewport(Position first, Size size);
+    void RemoveViewport(int viewport);
+
+private:
+    friend class Sheet;
+
+    // Called by the sheet whenever it clears a cash or sets a cell
+    void MarkDirty(Position pos);
+    // After a structural edit the planned positions are stale: plans again
+    // from every cell without a value
+    void MarkAllDirty();
+    // Merges the dirty cells into the rest of the plan, in topological
+    // order, the cells the viewports need first
+    void Plan();
+    // Asked by the sheet before it evicts a cash
+    bool IsPinned(Position pos) const;
+
+    struct Viewport
+    {
+        Position first;
+        Size size;
+    };
+
+    Sheet& sheet;
+    std::set<Position> dirty;  // reported since the last plan
+    bool replan = false;       // the viewports changed since the last plan
+    std::vector<Position> order;
+    std::size_t visible_end = 0;  // the cells the viewports need come before it
+    std::size_t next = 0;
+    std::set<Position> pinned;  // the planned cells and their inputs, until the plan is done
+
+    std::map<int, Viewport> viewports;
+    int next_viewport = 0;
+};
@@ -1,16 +1,24 @@
 #include "sheet.h"
 
+#include "allocations.h"
+#include "batch.h"
 #include "cell.h"
 #include "common.h"
+#include "memory.h"
+#include "recalculator.h"
+#include "workbook.h"
 
 #include <algorithm>
 #include <functional>
 #include <iostream>
+#include <memory>
+#include <unordered_set>
 
 using namespace std::literals;
 
 std::set<Position> DependeciesGraph::GetAllDependenciesFrom(Position from) const
 {
+    SPREADSHEET_ALLOCATION_SCOPE("DependeciesGraph::GetAllDependenciesFrom");
     std::set<Position> visited;
     return GetAllDependenciesFrom(from, visited);
 }
@@ -40,41 +48,253 @@ std::set<Position> DependeciesGraph::GetAllDependenciesFrom(Position from, std::
         return result;
     }
 }
+std::set<Position> DependeciesGraph::GetAllDependenciesFrom(const std::set<Position>& from) const
+{
+    SPREADSHEET_ALLOCATION_SCOPE("DependeciesGraph::GetAllDependenciesFrom");
+    std::set<Position> result;
+    std::vector<Position> queue(from.begin(), from.end());
+
+    while (!queue.empty())
+    {
+        auto it = reversed_edges.find(queue.back());
+        queue.pop_back();
+
+        if (it == reversed_edges.end())
+            continue;
+
+        for (const Position& pos : it->second)
+        {
+            if (result.insert(pos).second)
+                queue.push_back(pos);
+        }
+    }
+
+    return result;
+}
 void DependeciesGraph::AddEdges(Position to, const std::vector<Position>& from)
 {
-    edges.erase(to);
+    RemoveCell(to);
 
     for (const Position& pos : from)
     {
-        edges[to].insert(pos);
+        edge_count += edges[to].insert(pos).second;
         reversed_edges[pos].insert(to);
     }
 }
 
 void DependeciesGraph::RemoveCell(Position pos)
 {
-    edges.erase(pos);
+    auto it = edges.find(pos);
+
+    if (it == edges.end())
+        return;
+
+    // stale reversed edges would invalidate too much and report cycles that no longer exist
+    for (const Position& p : it->second)
+    {
+        auto reversed = reversed_edges.find(p);
+        reversed->second.erase(pos);
+        if (reversed->second.empty())
+            reversed_edges.erase(reversed);
+    }
+
+    edge_count -= it->second.size();
+    edges.erase(it);
+}
+
+bool DependeciesGraph::HasCycleFrom(const std::vector<Position>& from) const
+{
+    struct Frame
+    {
+        Position pos;
+        std::set<Position>::const_iterator next;
+        std::set<Position>::const_iterator end;
+    };
+
+    // true while the cell is on the current path, false once all its references are done
+    std::map<Position, bool> on_path;
+    std::vector<Frame> stack;
+
+    auto push = [this, &on_path, &stack](Position pos)
+    {
+        on_path[pos] = true;
+
+        auto it = edges.find(pos);
+        if (it == edges.end())
+            stack.push_back({pos, {}, {}});
+        else
+            stack.push_back({pos, it->second.begin(), it->second.end()});
+    };
+
+    for (const Position& start : from)
+    {
+        if (on_path.find(start) != on_path.end())
+            continue;
+
+        push(start);
+        while (!stack.empty())
+        {
+            Frame& frame = stack.back();
+            if (frame.next == frame.end)
+            {
+                on_path[frame.pos] = false;
+                stack.pop_back();
+                continue;
+            }
+
+            Position next = *frame.next++;
+            auto it = on_path.find(next);
+
+            if (it == on_path.end())
+                push(next);
+            else if (it->second)
+            {
+                SPREADSHEET_METRIC_ADD(CycleCheckVisits, on_path.size());
+                return true;
+            }
+        }
+    }
+
+    SPREADSHEET_METRIC_ADD(CycleCheckVisits, on_path.size());
+    return false;
+}
+
+std::vector<Position> DependeciesGraph::GetDependents(Position pos) const
+{
+    auto it = reversed_edges.find(pos);
+
+    if (it == reversed_edges.end())
+        return {};
+    else
+        return {it->second.begin(), it->second.end()};
+}
+bool DependeciesGraph::IsReferenced(Position pos) const
+{
+    return reversed_edges.find(pos) != reversed_edges.end();
+}
+std::vector<Position> DependeciesGraph::GetReferencedPositions(const ReferenceShift& shift) const
+{
+    std::vector<Position> result;
+
+    auto it = shift.axis == ReferenceShift::Axis::Rows ? reversed_edges.lower_bound({shift.first, 0}) : reversed_edges.begin();
+    for (; it != reversed_edges.end(); ++it)
+    {
+        if (shift.Affects(it->first))
+            result.push_back(it->first);
+    }
+
+    return result;
+}
+
+std::size_t DependeciesGraph::GetNodeCount() const
+{
+    std::size_t result = edges.size();
+    for (const auto& [pos, dependents] : reversed_edges)
+    {
+        result += edges.find(pos) == edges.end();
+    }
+
+    return result;
+}
+std::size_t DependeciesGraph::GetEdgeCount() const
+{
+    return edge_count;
+}
+std::size_t DependeciesGraph::GetMemoryUsage() const
+{
+    // every edge is one node in a set of each map
+    return (edges.size() + reversed_edges.size()) * Memory::TreeNode<std::map<Position, std::set<Position>>::value_type>()
+        + 2 * edge_count * Memory::TreeNode<Position>();
 }
 
+SheetSnapshot::SheetSnapshot(std::shared_ptr<const CellStorage::Index> index, Size size, std::uint64_t version, const WorkbookSnapshot* workbook) : index(std::move(index)), size(size), version(version), workbook(workbook) {}
+
+CellInterface::Value SheetSnapshot::GetCellValue(Position pos) const
+{
+    if (!pos.IsValid())
+        return FormulaError(FormulaError::Category::Ref);
+
+    const Cell* cell = CellStorage::Get(*index, pos);
+
+    if (cell)
+        return cell->GetValue(*this);
+    else
+        return "";
+}
+CellInterface::Value SheetSnapshot::GetSheetCellValue(const SheetReference& ref) const
+{
+    if (workbook)
+        return workbook->GetCellValue(ref);
+    else
+        return FormulaError(FormulaError::Category::Ref);
+}
+std::string SheetSnapshot::GetCellText(Position pos) const
+{
+    if (!pos.IsValid())
+        throw InvalidPositionException("");
+
+    const Cell* cell = CellStorage::Get(*index, pos);
+
+    if (cell)
+        return cell->GetText();
+    else
+        return "";
+}
+
+Size SheetSnapshot::GetPrintableSize() const
+{
+    return size;
+}
+std::uint64_t SheetSnapshot::GetVersion() const
+{
+    return version;
+}
+
+void SheetSnapshot::Recalculate() const
+{
+    BatchEvaluator(*index, *this).Run();
+
+    for (const auto& [key, block] : *index)
+    {
+        for (const std::shared_ptr<Cell>& cell : block->cells)
+        {
+            if (cell)
+                cell->GetValue(*this);
+        }
+    }
+}
+
+Sheet::Sheet() : placeholder(std::make_unique<Cell>(*this)) {}
+Sheet::Sheet(Workbook& workbook, std::string name) : placeholder(std::make_unique<Cell>(*this)), workbook(&workbook), name(std::move(name)) {}
 Sheet::~Sheet() {}
 
+const std::string& Sheet::GetName() const
+{
+    return name;
+}
+
 void Sheet::SetCell(Position pos, std::string text)
+{
+    SPREADSHEET_ALLOCATION_SCOPE("Sheet::SetCell");
+    EditJournal::Step step;
+    DoSetCell(pos, std::move(text), step);
+    journal.Record(std::move(step));
+    TrimCash();
+}
+void Sheet::DoSetCell(Position pos, std::string text, EditJournal::Step& step)
 {
     if (!pos.IsValid())
         throw InvalidPositionException("");
-    
-    if ((int)cells.size() <= pos.row)
-        cells.resize(pos.row + 1);
-    if ((int)cells[pos.row].size() <= pos.col)
-        cells[pos.row].resize(pos.col + 1);
-    
-    if (cells[pos.row][pos.col].get())
-    {
-        if (cells[pos.row][pos.col].get()->GetText() == text)
+
+    std::optional<std::string> before;
+    if (const Cell* existing = storage.Get(pos))
+    {
+        before = existing->GetText();
+        if (*before == text)
             return;
     }
 
-    std::unique_ptr<Cell> cell = std::unique_ptr<Cell>(new Cell(*this));
+    std::shared_ptr<Cell> cell = std::make_shared<Cell>(*this);
 
     try
     {
@@ -85,24 +305,29 @@ void Sheet::SetCell(Position pos, std::string text)
         std::throw_with_nested(FormulaException(exc.what()));
     }
 
-    std::vector<Position> dependencies_to = cell->GetReferencedCells();
+    const std::vector<Position>& dependencies_to = cell->GetReferencedCells();
     std::set<Position> dependencies_from = graph.GetAllDependenciesFrom(pos);
+    SPREADSHEET_METRIC_ADD(CycleCheckVisits, dependencies_from.size());
 
     if (std::any_of(dependencies_to.begin(), dependencies_to.end(), [&dependencies_from](const Position& p) { return dependencies_from.find(p) != dependencies_from.end(); }) || std::find(dependencies_to.begin(), dependencies_to.end(), pos) != dependencies_to.end())
         throw CircularDependencyException("");
 
-    graph.AddEdges(pos, dependencies_to);
+    std::vector<SheetReference> sheet_references = cell->GetSheetReferences();
+    if (workbook)
+        workbook->CheckCycles({name, pos}, dependencies_to, sheet_references, dependencies_from);
 
-    for (const Position p : dependencies_to)
-    {
-        if (GetCell(p) == nullptr)
-        {
-            SetCell(p, "");
-            positions.insert(p);
-        }
-    }
+    graph.AddEdges(pos, dependencies_to);
+    if (workbook)
+        workbook->SetSheetReferences({name, pos}, std::move(sheet_references));
 
-    cells[pos.row][pos.col] = std::move(cell);
+    step.push_back({pos, std::move(before), std::move(text)});
+    if (EvaluationProfiler* p = GetProfiler(); p && before)
+        p->Forget(storage.Get(pos));
+    NoteChange(pos);
+    ReleaseCash(storage.Get(pos));
+    storage.Set(pos, std::move(cell));
+    if (incremental)
+        incremental->MarkDirty(pos);
 
     positions.insert(pos);
 
@@ -110,41 +335,82 @@ void Sheet::SetCell(Position pos, std::string text)
     {
         ClearCash(p);
     }
+    SPREADSHEET_METRIC_ADD(CellsInvalidated, dependencies_from.size());
+    SPREADSHEET_METRIC_OBSERVE(InvalidatedPerEdit, dependencies_from.size());
+
+    if (workbook)
+    {
+        dependencies_from.insert(pos);
+        workbook->InvalidateDependents(name, dependencies_from);
+    }
+
+    ++version;
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const
 {
-    if (CheckPosition(pos))
-        return cells[pos.row][pos.col].get();
-    else
-        return nullptr;
+    CheckPosition(pos);
+
+    if (const Cell* cell = storage.Get(pos))
+        return cell;
+
+    // referenced positions without a cell exist only as keys of the graph
+    return graph.IsReferenced(pos) ? placeholder.get() : nullptr;
 }
 CellInterface* Sheet::GetCell(Position pos)
 {
-    if (CheckPosition(pos))
-        return cells[pos.row][pos.col].get();
-    else
-        return nullptr;
+    CheckPosition(pos);
+
+    if (Cell* cell = storage.Get(pos))
+        return cell;
+
+    return graph.IsReferenced(pos) ? placeholder.get() : nullptr;
 }
 
 void Sheet::ClearCell(Position pos)
 {
-    if (CheckPosition(pos))
-    {
-        if (cells[pos.row][pos.col] != nullptr)
-            cells[pos.row][pos.col].release();
+    SPREADSHEET_ALLOCATION_SCOPE("Sheet::ClearCell");
+    EditJournal::Step step;
+    DoClearCell(pos, step);
+    journal.Record(std::move(step));
+    TrimCash();
+}
+void Sheet::DoClearCell(Position pos, EditJournal::Step& step)
+{
+    CheckPosition(pos);
 
-        std::set<Position> cleaning_queue = graph.GetAllDependenciesFrom(pos);
+    const Cell* existing = storage.Get(pos);
+    if (!existing)
+        return;
 
-        for (const Position p : cleaning_queue)
-        {
-            ClearCash(p);
-        }
+    step.push_back({pos, existing->GetText(), std::nullopt});
+    if (EvaluationProfiler* p = GetProfiler())
+        p->Forget(existing);
+    NoteChange(pos);
+    ReleaseCash(existing);
+    storage.Set(pos, nullptr);
+
+    std::set<Position> cleaning_queue = graph.GetAllDependenciesFrom(pos);
+
+    for (const Position p : cleaning_queue)
+    {
+        ClearCash(p);
+    }
+    SPREADSHEET_METRIC_ADD(CellsInvalidated, cleaning_queue.size());
+    SPREADSHEET_METRIC_OBSERVE(InvalidatedPerEdit, cleaning_queue.size());
 
-        graph.RemoveCell(pos);
+    graph.RemoveCell(pos);
 
-        positions.erase(pos);
+    if (workbook)
+    {
+        workbook->SetSheetReferences({name, pos}, {});
+        cleaning_queue.insert(pos);
+        workbook->InvalidateDependents(name, cleaning_queue);
     }
+
+    positions.erase(pos);
+
+    ++version;
 }
 
 Size Sheet::GetPrintableSize() const
@@ -178,79 +444,853 @@ std::ostream& operator<<(std::ostream& output, CellInterface::Value v)
 
     return output;
 }
+
+namespace
+{
+    // Lays the rectangle out as rows of tab-separated cells, writing only the
+    // separators between the cells the cursor skips
+    template <typename CellPrinter>
+    void PrintCells(std::ostream& output, CellStorage::Cursor cursor, Position first, Size size, CellPrinter print_cell)
+    {
+        int row = 0;
+        int col = 0;
+
+        auto finish_row = [&output, &row, &col, &size]()
+        {
+            for (; col < size.cols - 1; ++col)
+            {
+                output << '\t';
+            }
+            output << '\n';
+            ++row;
+            col = 0;
+        };
+
+        for (; !cursor.Done(); cursor.Next())
+        {
+            Position pos = cursor.GetPosition();
+
+            while (row < pos.row - first.row)
+            {
+                finish_row();
+            }
+            for (; col < pos.col - first.col; ++col)
+            {
+                output << '\t';
+            }
+            print_cell(cursor.GetCell());
+        }
+
+        while (row < size.rows)
+        {
+            finish_row();
+        }
+    }
+}
+
 void Sheet::PrintValues(std::ostream& output) const
 {
-    if (cells.size() == 0)
+    PrintValues(output, {0, 0}, GetPrintableSize());
+}
+void Sheet::PrintTexts(std::ostream& output) const
+{
+    PrintTexts(output, {0, 0}, GetPrintableSize());
+}
+void Sheet::PrintValues(std::ostream& output, Position first, Size size) const
+{
+    SPREADSHEET_ALLOCATION_SCOPE("Sheet::PrintValues");
+    PrintCells(output, CellStorage::Cursor(storage.Share(), first, size), first, size, [&output](const Cell& cell) { output << cell.GetValue(); });
+}
+void Sheet::PrintTexts(std::ostream& output, Position first, Size size) const
+{
+    SPREADSHEET_ALLOCATION_SCOPE("Sheet::PrintTexts");
+    PrintCells(output, CellStorage::Cursor(storage.Share(), first, size), first, size, [&output](const Cell& cell) { output << cell.GetText(); });
+}
+CellCursor Sheet::GetCells(Position first, Size size) const
+{
+    return CellCursor(CellStorage::Cursor(storage.Share(), first, size), *this);
+}
+
+void SheetSnapshot::PrintValues(std::ostream& output) const
+{
+    PrintValues(output, {0, 0}, size);
+}
+void SheetSnapshot::PrintTexts(std::ostream& output) const
+{
+    PrintTexts(output, {0, 0}, size);
+}
+void SheetSnapshot::PrintValues(std::ostream& output, Position first, Size size) const
+{
+    PrintCells(output, CellStorage::Cursor(index, first, size), first, size, [this, &output](const Cell& cell) { output << cell.GetValue(*this); });
+}
+void SheetSnapshot::PrintTexts(std::ostream& output, Position first, Size size) const
+{
+    PrintCells(output, CellStorage::Cursor(index, first, size), first, size, [&output](const Cell& cell) { output << cell.GetText(); });
+}
+CellCursor SheetSnapshot::GetCells(Position first, Size size) const
+{
+    return CellCursor(CellStorage::Cursor(index, first, size), *this);
+}
+
+CellCursor::CellCursor(CellStorage::Cursor cells, const CellValueSource& source) : cells(std::move(cells)), source(&source)
+{
+}
+
+bool CellCursor::Done() const
+{
+    return cells.Done();
+}
+void CellCursor::Next()
+{
+    cells.Next();
+}
+
+Position CellCursor::GetPosition() const
+{
+    return cells.GetPosition();
+}
+std::string CellCursor::GetText() const
+{
+    return cells.GetCell().GetText();
+}
+CellInterface::Value CellCursor::GetValue() const
+{
+    return cells.GetCell().GetValue(*source);
+}
+
+CellInterface::Value Sheet::GetCellValue(Position pos) const
+{
+    SPREADSHEET_ALLOCATION_SCOPE("Sheet::GetCellValue");
+    if (!pos.IsValid())
+        return FormulaError(FormulaError::Category::Ref);
+
+    const Cell* cell = storage.Get(pos);
+
+    if (cell)
+        return cell->GetValue(*this);
+    else
+        return "";
+}
+
+CellInterface::Value Sheet::GetSheetCellValue(const SheetReference& ref) const
+{
+    if (workbook)
+        return workbook->GetCellValue(ref);
+    else
+        return FormulaError(FormulaError::Category::Ref);
+}
+
+void Sheet::ClearCash(Position pos)
+{
+    if (!pos.IsValid())
         return;
 
-    Size size = GetPrintableSize();
+    NoteChange(pos);
+    if (incremental)
+        incremental->MarkDirty(pos);
+    const Cell* shared = storage.Get(pos);
+    ReleaseCash(shared);
 
-    for (int i = 0; i < size.rows; i++)
+    // a cell shared with a snapshot keeps its cash there; the sheet gets a fresh copy
+    if (Cell* cell = storage.GetForWrite(pos))
     {
-        for (int j = 0; j < size.cols; j++)
+        cell->ClearCash();
+
+        if (EvaluationProfiler* p = GetProfiler())
         {
-            if (j < (int)cells[i].size())
+            if (cell != shared)
+                p->Rename(shared, cell);
+            p->RecordInvalidation(cell);
+        }
+    }
+}
+
+void Sheet::Recalculate() const
+{
+    SPREADSHEET_ALLOCATION_SCOPE("Sheet::Recalculate");
+    DoRecalculate(true);
+    DeliverDelta();
+}
+void Sheet::DoRecalculate(bool trim) const
+{
+    // the profiler times cells one by one, and a bounded cash counts them one by one
+    if (!GetProfiler() && !cash_pool.IsBounded())
+    {
+        std::shared_ptr<const CellStorage::Index> index = storage.Share();
+        BatchEvaluator(*index, *this).Run();
+    }
+
+    for (const Position& pos : positions)
+    {
+        CellInterface::Value value = storage.Get(pos)->GetValue();
+        if (!changed_cells.empty())
+            NoteValue(pos, value);
+        if (trim)
+            TrimCash();
+    }
+}
+
+void Sheet::SetCashBudget(std::size_t bytes)
+{
+    cash_pool.SetBudget(bytes);
+
+    // values computed while the cash was unbounded were not counted
+    if (cash_pool.IsBounded())
+        cash_pool.Recount(CountCash());
+    TrimCash();
+}
+CashPool& Sheet::GetCashPool()
+{
+    return cash_pool;
+}
+const CashPool& Sheet::GetCashPool() const
+{
+    return cash_pool;
+}
+void Sheet::TrimCash() const
+{
+    cash_pool.Trim(positions, [this](Position pos)
+    {
+        const Cell* cell = storage.Get(pos);
+        std::size_t bytes = cell ? cell->GetCashSize() : 0;
+
+        // a cell read since the hand last passed gets a second chance; one an
+        // incremental recalculation still needs stays
+        if (bytes == 0 || (incremental && incremental->IsPinned(pos)) || cell->TakeCashUse() || !storage.IsExclusive(pos) || !cell->EvictCash())
+            return CashPool::Visit{bytes, 0};
+        else
+            return CashPool::Visit{0, bytes};
+    });
+}
+void Sheet::ReleaseCash(const Cell* cell)
+{
+    if (cell && cash_pool.IsBounded())
+        cash_pool.Release(cell->GetCashSize());
+}
+std::size_t Sheet::CountCash() const
+{
+    std::size_t bytes = 0;
+    for (const Position& pos : positions)
+    {
+        bytes += storage.Get(pos)->GetCashSize();
+    }
+    return bytes;
+}
+
+bool Sheet::Undo()
+{
+    SPREADSHEET_ALLOCATION_SCOPE("Sheet::Undo");
+    std::optional<EditJournal::Step> step = journal.PopUndo();
+
+    if (!step)
+        return false;
+
+    // the whole step at once: a state halfway through it may have a cycle
+    try
+    {
+        WriteCells(ParseStep(*step, true));
+    }
+    catch (...)
+    {
+        journal.PushUndo(std::move(*step));
+        throw;
+    }
+    journal.PushRedo(std::move(*step));
+    TrimCash();
+
+    return true;
+}
+bool Sheet::Redo()
+{
+    SPREADSHEET_ALLOCATION_SCOPE("Sheet::Redo");
+    std::optional<EditJournal::Step> step = journal.PopRedo();
+
+    if (!step)
+        return false;
+
+    try
+    {
+        WriteCells(ParseStep(*step, false));
+    }
+    catch (...)
+    {
+        journal.PushRedo(std::move(*step));
+        throw;
+    }
+    journal.PushUndo(std::move(*step));
+    TrimCash();
+
+    return true;
+}
+void Sheet::SetJournalBudget(std::size_t bytes)
+{
+    journal.SetBudget(bytes);
+}
+void Sheet::FillRange(Position source, Size source_size, Position target, Size target_size)
+{
+    SPREADSHEET_ALLOCATION_SCOPE("Sheet::FillRange");
+    if (source_size.rows <= 0 || source_size.cols <= 0 || target_size.rows <= 0 || target_size.cols <= 0)
+        throw InvalidPositionException("");
+    for (const auto& [first, size] : {std::pair{source, source_size}, std::pair{target, target_size}})
+    {
+        if (!first.IsValid() || !Position{first.row + size.rows - 1, first.col + size.cols - 1}.IsValid())
+            throw InvalidPositionException("");
+    }
+
+    // every copy is made before anything is written: the blocks may overlap
+    std::vector<PendingCell> copies;
+    for (int i = 0; i < target_size.rows; ++i)
+    {
+        for (int j = 0; j < target_size.cols; ++j)
+        {
+            Position pos{target.row + i, target.col + j};
+            Position from{source.row + i % source_size.rows, source.col + j % source_size.cols};
+
+            std::shared_ptr<Cell> cell;
+            if (const Cell* original = storage.Get(from))
+                cell = original->CloneMoved(pos.row - from.row, pos.col - from.col);
+
+            std::vector<Position> references = cell ? cell->GetReferencedCells() : std::vector<Position>();
+            copies.push_back({pos, std::move(cell), std::move(references)});
+        }
+    }
+
+    journal.Record(WriteCells(std::move(copies)));
+    TrimCash();
+}
+EditJournal::Step Sheet::WriteCells(std::vector<PendingCell> cells)
+{
+    std::vector<Position> targets;
+    for (const PendingCell& pending : cells)
+    {
+        targets.push_back(pending.pos);
+    }
+
+    // with all the new edges in place a single search covers the whole block
+    for (const PendingCell& pending : cells)
+    {
+        graph.AddEdges(pending.pos, pending.references);
+    }
+
+    bool cycle = graph.HasCycleFrom(targets);
+    if (!cycle && workbook)
+    {
+        // a cycle through another sheet may take the edges of two cells of
+        // the block: the workbook sees all of them before the first check
+        for (const PendingCell& pending : cells)
+        {
+            workbook->SetSheetReferences({name, pending.pos}, pending.cell ? pending.cell->GetSheetReferences() : std::vector<SheetReference>());
+        }
+
+        std::set<Position> dependencies_from = graph.GetAllDependenciesFrom(std::set<Position>(targets.begin(), targets.end()));
+        for (const PendingCell& pending : cells)
+        {
+            try
             {
-                if (cells[i][j])
-                    output << cells[i][j]->GetValue();
+                workbook->CheckCycles({name, pending.pos}, pending.references, pending.cell ? pending.cell->GetSheetReferences() : std::vector<SheetReference>(), dependencies_from);
             }
-            if (j != size.cols - 1)
-                output << '\t';
+            catch (const CircularDependencyException&)
+            {
+                cycle = true;
+                break;
+            }
+        }
+
+        if (cycle)
+        {
+            for (const PendingCell& pending : cells)
+            {
+                const Cell* existing = storage.Get(pending.pos);
+                workbook->SetSheetReferences({name, pending.pos}, existing ? existing->GetSheetReferences() : std::vector<SheetReference>());
+            }
+        }
+    }
+
+    if (cycle)
+    {
+        for (const PendingCell& pending : cells)
+        {
+            const Cell* existing = storage.Get(pending.pos);
+            graph.AddEdges(pending.pos, existing ? existing->GetReferencedCells() : std::vector<Position>());
+        }
+        throw CircularDependencyException("");
+    }
+
+    EditJournal::Step step;
+    std::set<Position> changed;
+    for (PendingCell& pending : cells)
+    {
+        const Cell* existing = storage.Get(pending.pos);
+        if (!existing && !pending.cell)
+            continue;
+
+        std::optional<std::string> before, after;
+        if (existing)
+        {
+            before = existing->GetText();
+            if (EvaluationProfiler* p = GetProfiler())
+                p->Forget(existing);
+        }
+        if (pending.cell)
+        {
+            after = pending.cell->GetText();
+            positions.insert(pending.pos);
         }
-        output << '\n';
+        else
+            positions.erase(pending.pos);
+
+        if (workbook)
+            workbook->SetSheetReferences({name, pending.pos}, pending.cell ? pending.cell->GetSheetReferences() : std::vector<SheetReference>());
+
+        step.push_back({pending.pos, std::move(before), std::move(after)});
+        NoteChange(pending.pos);
+        ReleaseCash(existing);
+        storage.Set(pending.pos, std::move(pending.cell));
+        if (incremental)
+            incremental->MarkDirty(pending.pos);
+        changed.insert(pending.pos);
+    }
+
+    std::set<Position> dependencies_from = graph.GetAllDependenciesFrom(changed);
+    for (const Position& p : dependencies_from)
+    {
+        if (changed.find(p) == changed.end())
+            ClearCash(p);
+    }
+    SPREADSHEET_METRIC_ADD(CellsInvalidated, dependencies_from.size());
+    SPREADSHEET_METRIC_OBSERVE(InvalidatedPerEdit, dependencies_from.size());
+
+    if (workbook)
+    {
+        dependencies_from.insert(changed.begin(), changed.end());
+        workbook->InvalidateDependents(name, dependencies_from);
     }
+
+    ++version;
+    return step;
 }
-void Sheet::PrintTexts(std::ostream& output) const
+std::vector<Sheet::PendingCell> Sheet::ParseStep(const EditJournal::Step& step, bool before)
 {
-    if (cells.size() == 0)
+    // a position changed twice keeps the text at the far end of the step
+    std::map<Position, const std::optional<std::string>*> texts;
+    if (before)
+    {
+        for (auto it = step.rbegin(); it != step.rend(); ++it)
+        {
+            texts[it->pos] = &it->before;
+        }
+    }
+    else
+    {
+        for (const EditJournal::Change& change : step)
+        {
+            texts[change.pos] = &change.after;
+        }
+    }
+
+    std::vector<PendingCell> cells;
+    for (const auto& [pos, text] : texts)
+    {
+        std::shared_ptr<Cell> cell;
+        if (*text)
+        {
+            cell = std::make_shared<Cell>(*this);
+            cell->Set(**text);
+        }
+
+        std::vector<Position> references = cell ? cell->GetReferencedCells() : std::vector<Position>();
+        cells.push_back({pos, std::move(cell), std::move(references)});
+    }
+    return cells;
+}
+void Sheet::CopyRange(Position source, Size size, Position target)
+{
+    FillRange(source, size, target, size);
+}
+
+namespace
+{
+    // A negative count would turn an insertion into a deletion and back, and
+    // one past the axis would overflow the shifted positions
+    int CheckCount(int count, int limit)
+    {
+        if (count <= 0 || count > limit)
+            throw InvalidPositionException("");
+        return count;
+    }
+}
+
+void Sheet::InsertRows(int before, int count)
+{
+    ApplyShift({ReferenceShift::Axis::Rows, before, CheckCount(count, Position::GetMaxRows())});
+}
+void Sheet::InsertCols(int before, int count)
+{
+    ApplyShift({ReferenceShift::Axis::Cols, before, CheckCount(count, Position::GetMaxCols())});
+}
+void Sheet::DeleteRows(int first, int count)
+{
+    ApplyShift({ReferenceShift::Axis::Rows, first, -CheckCount(count, Position::GetMaxRows())});
+}
+void Sheet::DeleteCols(int first, int count)
+{
+    ApplyShift({ReferenceShift::Axis::Cols, first, -CheckCount(count, Position::GetMaxCols())});
+}
+
+void Sheet::ApplyShift(const ReferenceShift& shift)
+{
+    SPREADSHEET_ALLOCATION_SCOPE("Sheet::ApplyShift");
+    bool rows = shift.axis == ReferenceShift::Axis::Rows;
+    int limit = rows ? Position::GetMaxRows() : Position::GetMaxCols();
+
+    if (shift.first < 0 || shift.first >= limit)
+        throw InvalidPositionException("");
+    if (shift.delta == 0)
         return;
 
-    Size size = GetPrintableSize();
+    std::vector<Position> moved_cells;
+    for (auto it = rows ? positions.lower_bound({shift.first, 0}) : positions.begin(); it != positions.end(); ++it)
+    {
+        if (shift.Affects(*it))
+            moved_cells.push_back(*it);
+    }
+
+    if (shift.delta > 0)
+    {
+        int used = 0;
+        for (const Position& p : moved_cells)
+        {
+            used = std::max(used, (rows ? p.row : p.col) + 1);
+        }
+        if (used + shift.delta > limit)
+            throw TableTooBigException("");
+    }
 
-    for (int i = 0; i < size.rows; i++)
+    // formulas that reference anything that moves, and the cells whose edges are keyed by old positions
+    std::set<Position> referencing;
+    for (const std::vector<Position>& moved : {moved_cells, graph.GetReferencedPositions(shift)})
     {
-        for (int j = 0; j < size.cols; j++)
+        for (const Position& p : moved)
         {
-            if (j < (int)cells[i].size())
+            for (const Position& dependent : graph.GetDependents(p))
             {
-                if (cells[i][j])
-                    output << cells[i][j]->GetText();
+                referencing.insert(dependent);
             }
-            if (j != size.cols - 1)
-                output << '\t';
         }
-        output << '\n';
     }
+    std::set<Position> rewired(moved_cells.begin(), moved_cells.end());
+    rewired.insert(referencing.begin(), referencing.end());
+
+    for (const Position& p : rewired)
+    {
+        graph.RemoveCell(p);
+    }
+
+    for (const Position& p : moved_cells)
+    {
+        NoteChange(p);
+        NoteChange(shift.Apply(p));
+        if (workbook)
+            workbook->SetSheetReferences({name, p}, {});
+        positions.erase(p);
+        if (EvaluationProfiler* profiler_ = GetProfiler(); profiler_ && !shift.Apply(p).IsValid())
+            profiler_->Forget(storage.Get(p));
+    }
+    storage.Shift(shift);
+    for (const Position& p : moved_cells)
+    {
+        if (Position moved = shift.Apply(p); moved.IsValid())
+            positions.insert(moved);
+    }
+
+    std::vector<Position> broken;
+    for (const Position& p : referencing)
+    {
+        Position moved = shift.Apply(p);
+        if (!moved.IsValid())
+            continue;
+
+        if (storage.GetForWrite(moved)->HandleShift(shift) == FormulaInterface::HandlingResult::ReferencesChanged)
+            broken.push_back(moved);
+    }
+
+    for (const Position& p : rewired)
+    {
+        Position moved = shift.Apply(p);
+        if (!moved.IsValid())
+            continue;
+
+        if (const Cell* cell = storage.Get(moved))
+            graph.AddEdges(moved, cell->GetReferencedCells());
+    }
+
+    std::set<Position> changed;
+    for (const Position& p : broken)
+    {
+        for (const Position& dependent : graph.GetAllDependenciesFrom(p))
+        {
+            ClearCash(dependent);
+            changed.insert(dependent);
+        }
+        changed.insert(p);
+    }
+
+    // other sheets still point at the old addresses: whatever moved in or out of them changed
+    if (workbook)
+    {
+        for (const Position& p : moved_cells)
+        {
+            changed.insert(p);
+
+            Position moved = shift.Apply(p);
+            if (!moved.IsValid())
+                continue;
+
+            changed.insert(moved);
+            workbook->SetSheetReferences({name, moved}, storage.Get(moved)->GetSheetReferences());
+        }
+        workbook->InvalidateDependents(name, changed);
+    }
+
+    journal.Clear();
+    ++version;
+
+    if (incremental)
+        incremental->MarkAllDirty();
+    // the cells moved under the hand, and the deleted ones took their cashes along
+    if (cash_pool.IsBounded())
+        cash_pool.Recount(CountCash());
+    TrimCash();
 }
 
-void Sheet::ClearCash(Position pos)
+void Sheet::EnableProfiling(bool enable)
 {
-    if (!pos.IsValid())
+    if (enable && !profiler)
+        profiler = std::make_unique<EvaluationProfiler>();
+
+    active_profiler.store(enable ? profiler.get() : nullptr, std::memory_order_release);
+}
+EvaluationProfiler* Sheet::GetProfiler() const
+{
+    return active_profiler.load(std::memory_order_acquire);
+}
+std::vector<HotCell> Sheet::GetHotCells(std::size_t count) const
+{
+    if (!profiler)
+        return {};
+
+    std::unordered_map<const Cell*, EvaluationProfiler::CellStats> stats = profiler->GetStats();
+    std::vector<HotCell> result;
+
+    for (const Position& pos : positions)
+    {
+        const Cell* cell = storage.Get(pos);
+        auto it = stats.find(cell);
+
+        if (it == stats.end() || it->second.evaluations == 0)
+            continue;
+
+        result.push_back({pos, cell->GetText().substr(1), it->second});
+    }
+
+    std::sort(result.begin(), result.end(), [](const HotCell& lhs, const HotCell& rhs) { return lhs.stats.self_time > rhs.stats.self_time; });
+    if (result.size() > count)
+        result.resize(count);
+
+    return result;
+}
+void Sheet::PrintHotCells(std::ostream& output, std::size_t count) const
+{
+    output << "cell\tevaluations\tinvalidations\ttotal_us\tself_us\texpression\n";
+
+    for (const HotCell& hot : GetHotCells(count))
+    {
+        output << hot.pos.ToString() << '\t' << hot.stats.evaluations << '\t' << hot.stats.invalidations << '\t'
+               << hot.stats.total_time.count() / 1000.0 << '\t' << hot.stats.self_time.count() / 1000.0 << '\t'
+               << hot.expression << '\n';
+    }
+}
+
+FormulaCache& Sheet::GetFormulaCache()
+{
+    return formula_cache;
+}
+
+std::size_t MemoryReport::GetTotal() const
+{
+    return storage + values + texts + formulas + graph + positions;
+}
+
+MemoryReport Sheet::GetMemoryReport() const
+{
+    MemoryReport report;
+    std::unordered_set<const void*> counted;
+
+    report.storage = storage.GetMemoryUsage();
+    for (CellStorage::Cursor cursor(storage.Share(), {0, 0}, {Position::GetMaxRows(), Position::GetMaxCols()}); !cursor.Done(); cursor.Next())
+    {
+        cursor.GetCell().AddMemoryUsage(report, counted);
+    }
+    placeholder->AddMemoryUsage(report, counted);
+
+    report.formulas += formula_cache.GetMemoryUsage(counted);
+    report.graph = graph.GetMemoryUsage();
+    report.positions = positions.size() * Memory::TreeNode<Position>();
+
+    return report;
+}
+void Sheet::PrintMemoryReport(std::ostream& output) const
+{
+    MemoryReport report = GetMemoryReport();
+
+    output << "component\tbytes\n";
+    output << "storage\t" << report.storage << '\n';
+    output << "values\t" << report.values << '\n';
+    output << "texts\t" << report.texts << '\n';
+    output << "formulas\t" << report.formulas << '\n';
+    output << "graph\t" << report.graph << '\n';
+    output << "positions\t" << report.positions << '\n';
+    output << "total\t" << report.GetTotal() << '\n';
+}
+
+void Sheet::PrintMetrics(std::ostream& output) const
+{
+    std::uint64_t lookups = formula_cache.GetHits() + formula_cache.GetMisses();
+    std::uint64_t cash_reads = cash_pool.GetHits() + cash_pool.GetMisses();
+    MemoryReport memory = GetMemoryReport();
+
+    // the gauges of the sheets of one workbook tell each other apart by
+    // name; a valid sheet name needs no escaping
+    std::string labels = name.empty() ? std::string() : "sheet=\"" + name + "\"";
+
+    Metrics::WritePrometheus(output, Metrics::Collect(),
+    {
+        {"spreadsheet_cells", "Non-empty cells in the sheet", double(positions.size()), labels},
+        {"spreadsheet_graph_nodes", "Cells in the dependency graph", double(graph.GetNodeCount()), labels},
+        {"spreadsheet_graph_edges", "References in the dependency graph", double(graph.GetEdgeCount()), labels},
+        {"spreadsheet_formula_cache_entries", "Parsed formulas in the sheet's parse cache", double(formula_cache.GetSize()), labels},
+        {"spreadsheet_formula_cache_hit_ratio", "Share of formula texts found in the sheet's parse cache", lookups ? double(formula_cache.GetHits()) / lookups : 0.0, labels},
+        {"spreadsheet_memory_storage_bytes", "Bytes of the sheet's block index, blocks and cells", double(memory.storage), labels},
+        {"spreadsheet_memory_values_bytes", "Bytes of the sheet's cashed values", double(memory.values), labels},
+        {"spreadsheet_memory_texts_bytes", "Bytes of the sheet's text and number contents", double(memory.texts), labels},
+        {"spreadsheet_memory_formulas_bytes", "Bytes of the sheet's parsed formulas", double(memory.formulas), labels},
+        {"spreadsheet_memory_graph_bytes", "Bytes of the sheet's dependency graph", double(memory.graph), labels},
+        {"spreadsheet_memory_positions_bytes", "Bytes of the sheet's set of non-empty positions", double(memory.positions), labels},
+        {"spreadsheet_memory_bytes", "Bytes the sheet holds in all", double(memory.GetTotal()), labels},
+        {"spreadsheet_cash_budget_bytes", "Bytes the sheet's cashed values may hold; 0 for no bound", double(cash_pool.GetBudget()), labels},
+        {"spreadsheet_cash_resident_bytes", "Bytes of the values the sheet computed and still cashes, if bounded", double(cash_pool.GetResidentBytes()), labels},
+        {"spreadsheet_cash_hit_ratio", "Share of the sheet's own reads found in the cash, if bounded", cash_reads ? double(cash_pool.GetHits()) / cash_reads : 0.0, labels},
+        {"spreadsheet_sheet_cash_evicted_cells", "Cashes the sheet dropped to stay within its budget", double(cash_pool.GetEvictions()), labels},
+    });
+}
+
+int Sheet::Subscribe(DeltaCallback callback)
+{
+    subscribers.emplace(next_subscription, std::move(callback));
+    return next_subscription++;
+}
+void Sheet::Unsubscribe(int subscription)
+{
+    subscribers.erase(subscription);
+}
+void Sheet::BeginBatch()
+{
+    ++batch_depth;
+}
+void Sheet::EndBatch()
+{
+    if (batch_depth > 0)
+        --batch_depth;
+}
+
+void Sheet::NoteChange(Position pos)
+{
+    if (subscribers.empty() || !pos.IsValid() || changed_cells.count(pos))
+        return;
+
+    // a cell without a cash was never seen with a value: it is reported anyway
+    const Cell* cell = storage.Get(pos);
+    changed_cells.emplace(pos, cell ? cell->GetCashedValue() : CellInterface::Value(std::string()));
+}
+void Sheet::NoteValue(Position pos, const CellInterface::Value& value) const
+{
+    auto it = changed_cells.find(pos);
+    if (batch_depth > 0 || it == changed_cells.end())
         return;
 
-    if ((int)cells.size() <= pos.row)
+    if (!it->second || !(*it->second == value))
+        changed_values[pos] = value;
+    changed_cells.erase(it);
+}
+void Sheet::DeliverDelta() const
+{
+    SPREADSHEET_ALLOCATION_SCOPE("Sheet::DeliverDelta");
+    if (batch_depth > 0)
         return;
-    if ((int)cells[pos.row].size() <= pos.col)
+
+    // cells read since the edit have their values already; nothing else is evaluated
+    std::vector<std::pair<Position, CellInterface::Value>> known;
+    for (const auto& [pos, before] : changed_cells)
+    {
+        const Cell* cell = storage.Get(pos);
+        if (!cell)
+            known.emplace_back(pos, std::string());
+        else if (auto value = cell->GetCashedValue())
+            known.emplace_back(pos, std::move(*value));
+    }
+    for (const auto& [pos, value] : known)
+    {
+        NoteValue(pos, value);
+    }
+
+    if (changed_values.empty())
         return;
 
-    if (cells[pos.row][pos.col].get())
-        cells[pos.row][pos.col].get()->ClearCash();
+    SheetDelta delta{version, {}};
+    for (auto& [pos, value] : changed_values)
+    {
+        delta.changes.push_back({pos, std::move(value)});
+    }
+    changed_values.clear();
+
+    // a callback may unsubscribe itself
+    std::map<int, DeltaCallback> current = subscribers;
+    for (const auto& [id, callback] : current)
+    {
+        callback(delta);
+    }
+}
+
+std::shared_ptr<const SheetSnapshot> Sheet::Publish()
+{
+    if (workbook)
+    {
+        workbook->Publish();
+        return GetSnapshot();
+    }
+
+    std::shared_ptr<const SheetSnapshot> current = GetSnapshot();
+
+    if (current && current->GetVersion() == version)
+        return current;
+
+    auto snapshot = std::make_shared<const SheetSnapshot>(storage.Share(), GetPrintableSize(), version);
+    std::atomic_store(&published, snapshot);
+
+    return snapshot;
+}
+std::shared_ptr<const SheetSnapshot> Sheet::GetSnapshot() const
+{
+    return std::atomic_load(&published);
 }
 
-bool Sheet::CheckPosition(Position pos) const
+void Sheet::CheckPosition(Position pos) const
 {
     if (!pos.IsValid())
         throw InvalidPositionException("");
-
-    if ((int)cells.size() <= pos.row)
-        return false;
-    else if ((int)cells[pos.row].size() <= pos.col)
-        return false;
-    else
-        return true;
 }
 
 std::unique_ptr<SheetInterface> CreateSheet()
 {
     return std::make_unique<Sheet>();
-}
\ No newline at end of file
+}
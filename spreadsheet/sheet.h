@@ -1,37 +1,160 @@
 #pragma once
 
+#include "cash_pool.h"
 #include "cell.h"
 #include "common.h"
+#include "formula_cache.h"
+#include "journal.h"
+#include "metrics.h"
+#include "profiler.h"
+#include "storage.h"
 
+#include <atomic>
+#include <cstdint>
 #include <functional>
 #include <vector>
 #include <set>
 #include <map>
+#include <memory>
 #include <optional>
+#include <string>
 
 class Cell;
+class IncrementalRecalculator;
+class Workbook;
+class WorkbookSnapshot;
 
 class DependeciesGraph
 {
 public:
     std::set<Position> GetAllDependenciesFrom(Position from) const;
+    // Everything that depends on any of the cells, in one walk
+    std::set<Position> GetAllDependenciesFrom(const std::set<Position>& from) const;
     void AddEdges(Position to, const std::vector<Position>& from);
 
+    // Whether the references of the cells lead back to one of the cells they pass
+    bool HasCycleFrom(const std::vector<Position>& from) const;
+
     void RemoveCell(Position pos);
 
+    // Cells whose formulas reference pos directly
+    std::vector<Position> GetDependents(Position pos) const;
+    bool IsReferenced(Position pos) const;
+    // Referenced positions (with or without a cell) that the shift moves or deletes
+    std::vector<Position> GetReferencedPositions(const ReferenceShift& shift) const;
+
+    std::size_t GetNodeCount() const;
+    std::size_t GetEdgeCount() const;
+    // Bytes of both maps and the sets in them
+    std::size_t GetMemoryUsage() const;
+
 private:
     std::set<Position> GetAllDependenciesFrom(Position from, std::set<Position>& visited) const;
 
     std::map<Position, std::set<Position>> edges;
     std::map<Position, std::set<Position>> reversed_edges;
+    std::size_t edge_count = 0;
+};
+// The non-empty cells of a rectangle in row-major order, as the sheet or
+// snapshot that made it sees them. Values are computed through that source,
+// so a reader of a snapshot never evaluates against the live sheet; the
+// cursor must not outlive its source.
+class CellCursor
+{
+public:
+    CellCursor(CellStorage::Cursor cells, const CellValueSource& source);
+
+    bool Done() const;
+    void Next();
+
+    Position GetPosition() const;
+    std::string GetText() const;
+    CellInterface::Value GetValue() const;
+
+private:
+    CellStorage::Cursor cells;
+    const CellValueSource* source;
 };
-class Sheet : public SheetInterface
+// Immutable view of the sheet as of one Sheet::Publish() call. Readers may use
+// it from any thread while the writer keeps editing the sheet.
+class SheetSnapshot : public CellValueSource
 {
 public:
+    SheetSnapshot(std::shared_ptr<const CellStorage::Index> index, Size size, std::uint64_t version, const WorkbookSnapshot* workbook = nullptr);
+
+    CellInterface::Value GetCellValue(Position pos) const override;
+    CellInterface::Value GetSheetCellValue(const SheetReference& ref) const override;
+    std::string GetCellText(Position pos) const;
+
+    Size GetPrintableSize() const;
+    std::uint64_t GetVersion() const;
+
+    // Evaluates every cell whose value is not in its cash, runs of formulas
+    // of one shape together (see BatchEvaluator)
+    void Recalculate() const;
+
+    void PrintValues(std::ostream& output) const;
+    void PrintTexts(std::ostream& output) const;
+    void PrintValues(std::ostream& output, Position first, Size size) const;
+    void PrintTexts(std::ostream& output, Position first, Size size) const;
+    CellCursor GetCells(Position first, Size size) const;
+
+private:
+    std::shared_ptr<const CellStorage::Index> index;
+    Size size;
+    std::uint64_t version;
+    // the other sheets as of the same Workbook::Publish(), if the sheet belongs to one
+    const WorkbookSnapshot* workbook;
+};
+// A cell whose computed value a recalculation found changed
+struct CellChange
+{
+    Position pos;
+    CellInterface::Value value;  // an empty string for a cleared cell
+};
+// The cells whose values changed since the last delta, as a recalculation
+// pass found them, in row-major order
+struct SheetDelta
+{
+    std::uint64_t version;
+    std::vector<CellChange> changes;
+};
+
+// Bytes a sheet holds, by part (see Sheet::GetMemoryReport). Contents and
+// formulas shared by several cells are counted once.
+struct MemoryReport
+{
+    std::size_t storage = 0;    // the block index, the blocks and the cells themselves
+    std::size_t values = 0;     // the cashes of the cells, with the text of cashed strings
+    std::size_t texts = 0;      // the contents of text and number cells
+    std::size_t formulas = 0;   // parsed formulas, including the ones only the parse cache holds
+    std::size_t graph = 0;      // the dependency graph
+    std::size_t positions = 0;  // the set of non-empty positions
+
+    std::size_t GetTotal() const;
+};
+
+struct HotCell
+{
+    Position pos;
+    std::string expression;
+    EvaluationProfiler::CellStats stats;
+};
+
+class Sheet : public SheetInterface, public CellValueSource
+{
+public:
+    Sheet();
+    // A sheet of a workbook; see Workbook::AddSheet
+    Sheet(Workbook& workbook, std::string name);
     ~Sheet();
 
+    const std::string& GetName() const;
+
     void SetCell(Position pos, std::string text) override;
 
+    // A position that formulas reference but nothing was set at reads as an
+    // empty cell; it takes no storage and does not widen the printable area
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
 
@@ -41,13 +164,160 @@ public:
 
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
+    // Only the rectangle, laid out as the whole sheet would be; the cost
+    // follows the non-empty cells inside it, not the size of the sheet
+    void PrintValues(std::ostream& output, Position first, Size size) const;
+    void PrintTexts(std::ostream& output, Position first, Size size) const;
+    // The non-empty cells of the rectangle in row-major order. The cursor
+    // sees the sheet as of this call, like a snapshot would.
+    CellCursor GetCells(Position first, Size size) const;
+
+    CellInterface::Value GetCellValue(Position pos) const override;
+    CellInterface::Value GetSheetCellValue(const SheetReference& ref) const override;
 
     void ClearCash(Position pos);
+    // Evaluates every cell whose value is not in its cash, runs of formulas
+    // of one shape together unless profiling is on or the cash is bounded
+    void Recalculate() const;
+
+    // Bounded cash mode (see CashPool); zero, the default, keeps every value.
+    // The budget is enforced only by the calls that edit or recalculate the
+    // sheet, never by reads, so readers on other threads never see a cash
+    // evicted under them. Reads and one evaluation may pass it until the next
+    // such call, and cells a published snapshot (or a cursor) still shares
+    // keep their cashes.
+    void SetCashBudget(std::size_t bytes);
+    CashPool& GetCashPool();
+    const CashPool& GetCashPool() const;
+
+    // Profiling stays cheap enough to leave on; disabling keeps the collected stats
+    void EnableProfiling(bool enable);
+    EvaluationProfiler* GetProfiler() const;
+    // Formula cells ordered by self time, the most expensive first
+    std::vector<HotCell> GetHotCells(std::size_t count) const;
+    void PrintHotCells(std::ostream& output, std::size_t count) const;
+
+    // Structural edits: cells move, formulas keep pointing at the same cells
+    // without being parsed again, and references to deleted cells become #REF!.
+    // References from other sheets of a workbook keep their addresses.
+    // They clear the undo history.
+    void InsertRows(int before, int count = 1);
+    void InsertCols(int before, int count = 1);
+    void DeleteRows(int first, int count = 1);
+    void DeleteCols(int first, int count = 1);
+
+    // Copies cells without parsing their formulas again: every reference keeps
+    // its offset from the copy, and the ones that leave the sheet become #REF!.
+    // The source block repeats across the target block (a fill-down copies one
+    // row into many). The whole target block is checked for cycles at once and
+    // makes a single undo step.
+    void FillRange(Position source, Size source_size, Position target, Size target_size);
+    void CopyRange(Position source, Size size, Position target);
+
+    // Subscribers hear from every recalculation (Recalculate(), the one of
+    // the workbook or an IncrementalRecalculator run) about the cells edits
+    // invalidated whose values it found changed, with the new values. Edits
+    // alone evaluate nothing.
+    using DeltaCallback = std::function<void(const SheetDelta&)>;
+    int Subscribe(DeltaCallback callback);
+    void Unsubscribe(int subscription);
+    // Recalculations between the calls deliver nothing; the first one after
+    // reports the whole batch as one delta. Batches nest.
+    void BeginBatch();
+    void EndBatch();
+
+    // Both return false when there is nothing to undo/redo
+    bool Undo();
+    bool Redo();
+    void SetJournalBudget(std::size_t bytes);
+
+    // Formula texts set on this sheet are parsed through it
+    FormulaCache& GetFormulaCache();
+
+    // Walks every cell, so it costs about as much as printing the sheet
+    MemoryReport GetMemoryReport() const;
+    void PrintMemoryReport(std::ostream& output) const;
+
+    // Engine-wide counters plus this sheet's gauges, in Prometheus text format
+    void PrintMetrics(std::ostream& output) const;
+
+    // Writer side: makes the current state visible to GetSnapshot() callers.
+    // A sheet of a workbook publishes the whole workbook (see Workbook::Publish).
+    std::shared_ptr<const SheetSnapshot> Publish();
+    // Reader side: the latest published version, safe to call from any thread
+    std::shared_ptr<const SheetSnapshot> GetSnapshot() const;
 
 private:
-    bool CheckPosition(Position pos) const;
+    friend class IncrementalRecalculator;
+    friend class Workbook;
+
+    void CheckPosition(Position pos) const;
+
+    void DoSetCell(Position pos, std::string text, EditJournal::Step& step);
+    void DoClearCell(Position pos, EditJournal::Step& step);
+
+    // A cell a multi-cell edit is about to write; null empties the position
+    struct PendingCell
+    {
+        Position pos;
+        std::shared_ptr<Cell> cell;
+        std::vector<Position> references;
+    };
+    // Writes the cells as one edit: all their edges go in before a single
+    // cycle check, so only the end state has to be acyclic. A cycle throws
+    // CircularDependencyException and leaves the sheet as it was.
+    EditJournal::Step WriteCells(std::vector<PendingCell> cells);
+    // The cells a recorded step leaves behind, or found before it
+    std::vector<PendingCell> ParseStep(const EditJournal::Step& step, bool before);
+
+    void ApplyShift(const ReferenceShift& shift);
+
+    // Recalculate() that may trim the cash as it goes; Workbook::Recalculate
+    // evaluates its sheets in parallel and trims after all of them are done
+    void DoRecalculate(bool trim) const;
+    // Evicts cashes until the budget holds again; only from the writer's calls
+    void TrimCash() const;
+    // The cash of a cell the sheet clears or drops stops counting against the budget
+    void ReleaseCash(const Cell* cell);
+    std::size_t CountCash() const;
+
+    // Remembers the value at pos before an edit changes it
+    void NoteChange(Position pos);
+    // A recalculation computed the value at pos
+    void NoteValue(Position pos, const CellInterface::Value& value) const;
+    // Reports the noted cells whose values were computed, the cleared ones
+    // and the ones still cashed, if they changed
+    void DeliverDelta() const;
 
     DependeciesGraph graph;
+    EditJournal journal;
+    FormulaCache formula_cache;
     std::set<Position> positions;
-    std::vector<std::vector<std::unique_ptr<Cell>>> cells;
+    CellStorage storage;
+    // the one empty cell GetCell returns for every referenced empty position
+    std::unique_ptr<Cell> placeholder;
+
+    std::uint64_t version = 0;
+    std::shared_ptr<const SheetSnapshot> published;
+
+    std::unique_ptr<EvaluationProfiler> profiler;
+    std::atomic<EvaluationProfiler*> active_profiler = nullptr;
+
+    // trimmed by Recalculate too, which is const like the cashes it counts
+    mutable CashPool cash_pool;
+
+    // hears about every cell an edit leaves without a value, while attached
+    IncrementalRecalculator* incremental = nullptr;
+
+    std::map<int, DeltaCallback> subscribers;
+    int next_subscription = 0;
+    int batch_depth = 0;
+    // the value each cell edits invalidated had before them, if it was
+    // known, and the new values recalculations found; both filled by const
+    // recalculations
+    mutable std::map<Position, std::optional<CellInterface::Value>> changed_cells;
+    mutable std::map<Position, CellInterface::Value> changed_values;
+
+    Workbook* workbook = nullptr;
+    std::string name;
 };
\ No newline at end of file
@@ -0,0 +1,276 @@
+#include "storage.h"
+
+#include "cell.h"
+#include "memory.h"
+
+#include <algorithm>
+
+CellStorage::CellStorage() : index(std::make_shared<Index>()) {}
+
+Cell* CellStorage::Get(Position pos) const
+{
+    return Get(*index, pos);
+}
+Cell* CellStorage::Get(const Index& index, Position pos)
+{
+    auto it = index.find(BlockOf(pos));
+
+    if (it == index.end())
+        return nullptr;
+    else
+        return it->second->cells[SlotOf(pos)].get();
+}
+
+void CellStorage::GetColumn(const Index& index, Position first, int count, const Cell** cells)
+{
+    int row = first.row;
+    const int end = first.row + count;
+
+    while (row < end)
+    {
+        Position pos{row, first.col};
+        int band_end = std::min(end, (row / BLOCK_SIZE + 1) * BLOCK_SIZE);
+
+        auto it = index.find(BlockOf(pos));
+        for (; row < band_end; ++row, ++cells, ++pos.row)
+        {
+            *cells = it == index.end() ? nullptr : it->second->cells[SlotOf(pos)].get();
+        }
+    }
+}
+
+void CellStorage::Set(Position pos, std::shared_ptr<Cell> cell)
+{
+    if (!cell && !Get(pos))
+        return;
+
+    Index& idx = IndexForWrite();
+    Position key = BlockOf(pos);
+
+    auto it = idx.find(key);
+    if (it == idx.end())
+        it = idx.emplace(key, std::make_shared<Block>()).first;
+
+    Block& block = BlockForWrite(it);
+    std::shared_ptr<Cell>& slot = block.cells[SlotOf(pos)];
+
+    block.count += (cell != nullptr) - (slot != nullptr);
+    slot = std::move(cell);
+
+    if (block.count == 0)
+        idx.erase(it);
+}
+Cell* CellStorage::GetForWrite(Position pos)
+{
+    if (!Get(pos))
+        return nullptr;
+
+    Index& idx = IndexForWrite();
+    Block& block = BlockForWrite(idx.find(BlockOf(pos)));
+    std::shared_ptr<Cell>& slot = block.cells[SlotOf(pos)];
+
+    if (slot.use_count() > 1)
+        slot = slot->CloneWithoutCash();
+
+    return slot.get();
+}
+bool CellStorage::IsExclusive(Position pos) const
+{
+    if (index.use_count() > 1)
+        return false;
+
+    auto it = index->find(BlockOf(pos));
+    return it != index->end() && it->second.use_count() == 1 && it->second->cells[SlotOf(pos)].use_count() == 1;
+}
+
+void CellStorage::Shift(const ReferenceShift& shift)
+{
+    bool rows = shift.axis == ReferenceShift::Axis::Rows;
+    int first_block = shift.first / BLOCK_SIZE;
+
+    Index& idx = IndexForWrite();
+    std::vector<std::pair<Position, std::shared_ptr<Block>>> moved;
+
+    // blocks are ordered by row, so for rows the affected ones are a suffix of the index
+    auto it = rows ? idx.lower_bound({first_block, 0}) : idx.begin();
+    while (it != idx.end())
+    {
+        if ((rows ? it->first.row : it->first.col) >= first_block)
+        {
+            moved.emplace_back(it->first, std::move(it->second));
+            it = idx.erase(it);
+        }
+        else
+            ++it;
+    }
+
+    if (shift.first % BLOCK_SIZE == 0 && shift.delta % BLOCK_SIZE == 0)
+    {
+        for (auto& [key, block] : moved)
+        {
+            Position origin = shift.Apply({key.row * BLOCK_SIZE, key.col * BLOCK_SIZE});
+            if (origin.IsValid())
+                idx.emplace(BlockOf(origin), std::move(block));
+        }
+        return;
+    }
+
+    // the moved blocks may still belong to a snapshot: read from them, never write
+    for (const auto& [key, block] : moved)
+    {
+        for (int slot = 0; slot < BLOCK_SIZE * BLOCK_SIZE; ++slot)
+        {
+            if (!block->cells[slot])
+                continue;
+
+            Position pos = shift.Apply({key.row * BLOCK_SIZE + slot / BLOCK_SIZE, key.col * BLOCK_SIZE + slot % BLOCK_SIZE});
+            if (pos.IsValid())
+                Set(pos, block->cells[slot]);
+        }
+    }
+}
+
+std::shared_ptr<const CellStorage::Index> CellStorage::Share() const
+{
+    return index;
+}
+
+std::size_t CellStorage::GetMemoryUsage() const
+{
+    return Memory::Shared<Index>() + index->size() * (Memory::TreeNode<Index::value_type>() + Memory::Shared<Block>());
+}
+
+Position CellStorage::BlockOf(Position pos)
+{
+    return {pos.row / BLOCK_SIZE, pos.col / BLOCK_SIZE};
+}
+int CellStorage::SlotOf(Position pos)
+{
+    return (pos.row % BLOCK_SIZE) * BLOCK_SIZE + pos.col % BLOCK_SIZE;
+}
+
+CellStorage::Index& CellStorage::IndexForWrite()
+{
+    // a snapshot still holds the current index: leave it alone and work on a copy
+    if (index.use_count() > 1)
+        index = std::make_shared<Index>(*index);
+
+    return *index;
+}
+CellStorage::Block& CellStorage::BlockForWrite(Index::iterator it)
+{
+    if (it->second.use_count() > 1)
+        it->second = std::make_shared<Block>(*it->second);
+
+    return *it->second;
+}
+
+CellStorage::Cursor::Cursor(std::shared_ptr<const Index> index, Position first, Size size) : index(std::move(index)), first(first)
+{
+    if (!first.IsValid() || size.rows <= 0 || size.cols <= 0)
+    {
+        done = true;
+        return;
+    }
+
+    // clamped before adding: a size up to INT_MAX must not wrap around
+    last = {first.row + std::min(size.rows, Position::GetMaxRows() - first.row) - 1, first.col + std::min(size.cols, Position::GetMaxCols() - first.col) - 1};
+
+    if (!LoadBand(first.row / BLOCK_SIZE))
+        done = true;
+    else
+        Settle();
+}
+
+bool CellStorage::Cursor::Done() const
+{
+    return done;
+}
+void CellStorage::Cursor::Next()
+{
+    ++col;
+    Settle();
+}
+
+Position CellStorage::Cursor::GetPosition() const
+{
+    return {row, col};
+}
+const Cell& CellStorage::Cursor::GetCell() const
+{
+    return *blocks[block].second->cells[SlotOf({row, col})];
+}
+
+bool CellStorage::Cursor::LoadBand(int from)
+{
+    int first_block_col = first.col / BLOCK_SIZE;
+    int last_block_col = last.col / BLOCK_SIZE;
+
+    band = from;
+    while (band <= last.row / BLOCK_SIZE)
+    {
+        auto it = index->lower_bound({band, first_block_col});
+        if (it == index->end())
+            return false;
+
+        // nothing left in this band: jump straight to the next one with blocks
+        if (it->first.row > band)
+        {
+            band = it->first.row;
+            continue;
+        }
+
+        blocks.clear();
+        for (; it != index->end() && it->first.row == band && it->first.col <= last_block_col; ++it)
+        {
+            blocks.emplace_back(it->first.col, it->second.get());
+        }
+
+        if (!blocks.empty())
+        {
+            row = std::max(first.row, band * BLOCK_SIZE);
+            block = 0;
+            col = std::max(first.col, blocks.front().first * BLOCK_SIZE);
+            return true;
+        }
+
+        ++band;
+    }
+
+    return false;
+}
+void CellStorage::Cursor::Settle()
+{
+    while (true)
+    {
+        if (block == blocks.size())
+        {
+            if (++row > std::min(last.row, band * BLOCK_SIZE + BLOCK_SIZE - 1))
+            {
+                if (!LoadBand(band + 1))
+                {
+                    done = true;
+                    return;
+                }
+            }
+            else
+            {
+                block = 0;
+                col = std::max(first.col, blocks.front().first * BLOCK_SIZE);
+            }
+            continue;
+        }
+
+        const auto& [block_col, current] = blocks[block];
+        int end_col = std::min(last.col, block_col * BLOCK_SIZE + BLOCK_SIZE - 1);
+
+        for (; col <= end_col; ++col)
+        {
+            if (current->cells[SlotOf({row, col})])
+                return;
+        }
+
+        if (++block < blocks.size())
+            col = std::max(first.col, blocks[block].first * BLOCK_SIZE);
+    }
+}
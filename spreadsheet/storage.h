@@ -0,0 +1,97 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+class Cell;
+
+// Sparse cell grid split into square blocks. The block index, the blocks and
+// the cells are all copy-on-write: Share() hands the current index out to a
+// snapshot, and later writes clone only the index, blocks and cells they touch.
+class CellStorage
+{
+public:
+    static const int BLOCK_SIZE = 16;
+
+    struct Block
+    {
+        std::array<std::shared_ptr<Cell>, BLOCK_SIZE * BLOCK_SIZE> cells;
+        int count = 0;
+    };
+    // keyed by block coordinates: {row / BLOCK_SIZE, col / BLOCK_SIZE}
+    using Index = std::map<Position, std::shared_ptr<Block>>;
+
+    // Walks the non-empty cells of a rectangle in row-major order. Blocks with
+    // no cells are never visited, so the cost follows the occupied part of the
+    // rectangle. The cursor holds on to the index it walks: writes to the
+    // storage after it was created do not show up in it.
+    class Cursor
+    {
+    public:
+        // The rectangle is clipped to the sheet limits
+        Cursor(std::shared_ptr<const Index> index, Position first, Size size);
+
+        bool Done() const;
+        void Next();
+
+        Position GetPosition() const;
+        const Cell& GetCell() const;
+
+    private:
+        // Loads the blocks of the first band of block rows, starting at `from`,
+        // that has any inside the rectangle
+        bool LoadBand(int from);
+        // Moves to the first non-empty cell at or after the current one
+        void Settle();
+
+        std::shared_ptr<const Index> index;
+        Position first;
+        Position last;
+        int band = 0;
+        std::vector<std::pair<int, const Block*>> blocks;  // of the band, by block column
+        int row = 0;
+        std::size_t block = 0;
+        int col = 0;
+        bool done = false;
+    };
+
+    CellStorage();
+
+    Cell* Get(Position pos) const;
+    static Cell* Get(const Index& index, Position pos);
+    // The cells of `count` rows of one column from `first` down, nullptr for
+    // empty ones; looks every block up once
+    static void GetColumn(const Index& index, Position first, int count, const Cell** cells);
+
+    void Set(Position pos, std::shared_ptr<Cell> cell);
+    // Returns the cell at pos owned by this storage alone, cloning it (without
+    // its cash) if a published snapshot still shares it.
+    Cell* GetForWrite(Position pos);
+    // Whether only this storage holds the cell at pos: no snapshot or cursor
+    // shares it, its block or the index
+    bool IsExclusive(Position pos) const;
+
+    // Moves every cell at or after shift.first and drops the deleted ones.
+    // Blocks move as a whole when the shift is aligned to BLOCK_SIZE.
+    void Shift(const ReferenceShift& shift);
+
+    std::shared_ptr<const Index> Share() const;
+
+    // Bytes of the block index and the blocks, without the cells in them;
+    // blocks a snapshot shares are counted too
+    std::size_t GetMemoryUsage() const;
+
+private:
+    static Position BlockOf(Position pos);
+    static int SlotOf(Position pos);
+
+    Index& IndexForWrite();
+    Block& BlockForWrite(Index::iterator it);
+
+    std::shared_ptr<Index> index;
+};
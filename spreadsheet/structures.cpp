@@ -1,15 +1,39 @@
 #include "common.h"
 
+#include <atomic>
 #include <cctype>
+#include <charconv>
 #include <sstream>
 #include <algorithm>
 
 const int LETTERS = 26;
 const int MAX_POSITION_LENGTH = 17;
-const int MAX_POS_LETTER_COUNT = 3;
+
+namespace
+{
+    std::atomic<int> max_rows{Position::MAX_ROWS};
+    std::atomic<int> max_cols{Position::MAX_COLS};
+}
 
 const Position Position::NONE = {-1, -1};
 
+int Position::GetMaxRows()
+{
+    return max_rows.load(std::memory_order_relaxed);
+}
+int Position::GetMaxCols()
+{
+    return max_cols.load(std::memory_order_relaxed);
+}
+void Position::SetLimits(int rows, int cols)
+{
+    if (rows <= 0 || cols <= 0 || rows > MAX_ROWS || cols > MAX_COLS)
+        throw InvalidPositionException("Sheet limits out of range");
+
+    max_rows.store(rows, std::memory_order_relaxed);
+    max_cols.store(cols, std::memory_order_relaxed);
+}
+
 bool Position::operator==(const Position rhs) const
 {
     return row == rhs.row && col == rhs.col;
@@ -21,7 +45,7 @@ bool Position::operator<(const Position rhs) const
 
 bool Position::IsValid() const
 {
-    return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
+    return row >= 0 && col >= 0 && row < GetMaxRows() && col < GetMaxCols();
 }
 std::string Position::ToString() const
 {
@@ -54,28 +78,65 @@ Position Position::FromString(std::string_view str)
     if (letters.empty() || digits.empty())
         return Position::NONE;
 
-    if (letters.size() > MAX_POS_LETTER_COUNT)
-        return Position::NONE;
-
     if (!std::isdigit(digits[0]))
         return Position::NONE;
 
     int row;
-    std::istringstream row_in{std::string{digits}};
+    auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), row);
 
-    if (!(row_in >> row) || !row_in.eof())
+    if (error != std::errc() || end != digits.data() + digits.size())
         return Position::NONE;
 
+    // any number of letters, as long as the column stays in range
     int col = 0;
     for (char ch : letters)
     {
         col *= LETTERS;
         col += ch - 'A' + 1;
+
+        if (col > MAX_COLS)
+            return Position::NONE;
     }
 
     return {row - 1, col - 1};
 }
 
+bool ReferenceShift::Affects(Position pos) const
+{
+    return (axis == Axis::Rows ? pos.row : pos.col) >= first;
+}
+Position ReferenceShift::Apply(Position pos) const
+{
+    if (!pos.IsValid() || !Affects(pos))
+        return pos;
+
+    int& coord = axis == Axis::Rows ? pos.row : pos.col;
+
+    if (delta < 0 && coord < first - delta)
+        return Position::NONE;
+
+    coord += delta;
+
+    if (pos.IsValid())
+        return pos;
+    else
+        return Position::NONE;
+}
+
+bool SheetReference::operator==(const SheetReference& rhs) const
+{
+    return sheet == rhs.sheet && pos == rhs.pos;
+}
+bool SheetReference::operator<(const SheetReference& rhs) const
+{
+    return std::tie(sheet, pos) < std::tie(rhs.sheet, rhs.pos);
+}
+
+std::string SheetReference::ToString() const
+{
+    return sheet + '!' + pos.ToString();
+}
+
 bool Size::operator==(Size rhs) const
 {
     return cols == rhs.cols && rows == rhs.rows;
@@ -111,4 +172,9 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe)
 {
     output << fe.ToString();
     return output;
-}
\ No newline at end of file
+}
+
+CellInterface::Value CellValueSource::GetSheetCellValue(const SheetReference&) const
+{
+    return FormulaError(FormulaError::Category::Ref);
+}
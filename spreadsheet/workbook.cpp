@@ -0,0 +1,280 @@
+#include "workbook.h"
+
+#include "cell.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <future>
+
+namespace
+{
+    bool IsValidSheetName(std::string_view name)
+    {
+        if (name.empty() || !(std::isalpha(static_cast<unsigned char>(name[0])) || name[0] == '_'))
+            return false;
+
+        for (char ch : name)
+        {
+            if (!(std::isalnum(static_cast<unsigned char>(ch)) || ch == '_'))
+                return false;
+        }
+
+        return true;
+    }
+}
+
+const SheetSnapshot* WorkbookSnapshot::GetSheet(std::string_view name) const
+{
+    auto it = sheets.find(name);
+
+    if (it == sheets.end())
+        return nullptr;
+    else
+        return &it->second;
+}
+CellInterface::Value WorkbookSnapshot::GetCellValue(const SheetReference& ref) const
+{
+    if (const SheetSnapshot* sheet = GetSheet(ref.sheet))
+        return sheet->GetCellValue(ref.pos);
+    else
+        return FormulaError(FormulaError::Category::Ref);
+}
+
+Sheet& Workbook::AddSheet(std::string name)
+{
+    if (!IsValidSheetName(name))
+        throw InvalidSheetNameException("Invalid sheet name: " + name);
+    if (sheets.find(name) != sheets.end())
+        throw InvalidSheetNameException("Duplicate sheet name: " + name);
+
+    Sheet& sheet = *sheets.emplace(name, std::make_unique<Sheet>(*this, name)).first->second;
+
+    // formulas that referenced the sheet before it existed have cashed #REF!
+    std::set<Position> referenced;
+    for (auto it = dependents.lower_bound({name, Position::NONE}); it != dependents.end() && it->first.sheet == name; ++it)
+    {
+        referenced.insert(it->first.pos);
+    }
+    InvalidateDependents(name, referenced);
+
+    return sheet;
+}
+
+Sheet* Workbook::GetSheet(std::string_view name)
+{
+    auto it = sheets.find(name);
+
+    if (it == sheets.end())
+        return nullptr;
+    else
+        return it->second.get();
+}
+const Sheet* Workbook::GetSheet(std::string_view name) const
+{
+    auto it = sheets.find(name);
+
+    if (it == sheets.end())
+        return nullptr;
+    else
+        return it->second.get();
+}
+std::vector<std::string> Workbook::GetSheetNames() const
+{
+    std::vector<std::string> result;
+    for (const auto& [name, sheet] : sheets)
+    {
+        result.push_back(name);
+    }
+
+    return result;
+}
+
+CellInterface::Value Workbook::GetCellValue(const SheetReference& ref) const
+{
+    if (const Sheet* sheet = GetSheet(ref.sheet))
+        return sheet->GetCellValue(ref.pos);
+    else
+        return FormulaError(FormulaError::Category::Ref);
+}
+
+void Workbook::Recalculate() const
+{
+    std::vector<std::future<void>> tasks;
+    for (const auto& [name, sheet] : sheets)
+    {
+        tasks.push_back(std::async(std::launch::async, [&sheet = *sheet] { sheet.DoRecalculate(false); }));
+    }
+
+    for (std::future<void>& task : tasks)
+    {
+        task.get();
+    }
+
+    // the threads read each other's cells: no cash may go while any of them runs
+    for (const auto& [name, sheet] : sheets)
+    {
+        sheet->TrimCash();
+        sheet->DeliverDelta();
+    }
+}
+
+std::shared_ptr<const WorkbookSnapshot> Workbook::Publish()
+{
+    std::shared_ptr<const WorkbookSnapshot> current = GetSnapshot();
+
+    if (current && current->sheets.size() == sheets.size())
+    {
+        bool changed = false;
+        for (const auto& [name, sheet] : sheets)
+        {
+            const SheetSnapshot* published_sheet = current->GetSheet(name);
+            changed |= !published_sheet || published_sheet->GetVersion() != sheet->version;
+        }
+
+        if (!changed)
+            return current;
+    }
+
+    auto snapshot = std::make_shared<WorkbookSnapshot>();
+    for (const auto& [name, sheet] : sheets)
+    {
+        const SheetSnapshot& sheet_snapshot = snapshot->sheets.try_emplace(name, sheet->storage.Share(), sheet->GetPrintableSize(), sheet->version, snapshot.get()).first->second;
+        // the sheet snapshot keeps the whole workbook snapshot alive
+        std::atomic_store(&sheet->published, std::shared_ptr<const SheetSnapshot>(snapshot, &sheet_snapshot));
+    }
+    std::atomic_store(&published, std::shared_ptr<const WorkbookSnapshot>(snapshot));
+
+    return snapshot;
+}
+std::shared_ptr<const WorkbookSnapshot> Workbook::GetSnapshot() const
+{
+    return std::atomic_load(&published);
+}
+
+void Workbook::CheckCycles(const SheetReference& to, const std::vector<Position>& cells, const std::vector<SheetReference>& sheet_cells, const std::set<Position>& dependents_in_sheet) const
+{
+    // without edges between sheets every cycle stays inside one sheet, and the sheet has checked it
+    if (sheet_cells.empty() && dependents.empty())
+        return;
+
+    // a cycle through another sheet leaves this one from `to` or a cell
+    // downstream of it; the sheet has walked those already
+    if (sheet_cells.empty())
+    {
+        auto is_read_elsewhere = [this, &to](Position p) { return dependents.find({to.sheet, p}) != dependents.end(); };
+        if (!is_read_elsewhere(to.pos) && std::none_of(dependents_in_sheet.begin(), dependents_in_sheet.end(), is_read_elsewhere))
+            return;
+    }
+
+    std::set<SheetReference> downstream{to};
+    std::vector<SheetReference> queue{to};
+
+    while (!queue.empty())
+    {
+        SheetReference ref = std::move(queue.back());
+        queue.pop_back();
+
+        auto visit = [&downstream, &queue](SheetReference next)
+        {
+            if (downstream.insert(next).second)
+                queue.push_back(std::move(next));
+        };
+
+        if (const Sheet* sheet = GetSheet(ref.sheet))
+        {
+            for (const Position& p : sheet->graph.GetDependents(ref.pos))
+            {
+                visit({ref.sheet, p});
+            }
+        }
+        if (auto it = dependents.find(ref); it != dependents.end())
+        {
+            for (const SheetReference& next : it->second)
+            {
+                visit(next);
+            }
+        }
+    }
+    SPREADSHEET_METRIC_ADD(CycleCheckVisits, downstream.size());
+
+    for (const Position& p : cells)
+    {
+        if (downstream.find({to.sheet, p}) != downstream.end())
+            throw CircularDependencyException("");
+    }
+    for (const SheetReference& ref : sheet_cells)
+    {
+        if (downstream.find(ref) != downstream.end())
+            throw CircularDependencyException("");
+    }
+}
+
+void Workbook::SetSheetReferences(const SheetReference& to, std::vector<SheetReference> from)
+{
+    if (auto it = references.find(to); it != references.end())
+    {
+        for (const SheetReference& ref : it->second)
+        {
+            auto reversed = dependents.find(ref);
+            reversed->second.erase(to);
+            if (reversed->second.empty())
+                dependents.erase(reversed);
+        }
+        references.erase(it);
+    }
+
+    if (from.empty())
+        return;
+
+    for (const SheetReference& ref : from)
+    {
+        dependents[ref].insert(to);
+    }
+    references.emplace(to, std::move(from));
+}
+
+void Workbook::InvalidateDependents(const std::string& sheet, const std::set<Position>& changed)
+{
+    if (dependents.empty())
+        return;
+
+    std::vector<SheetReference> queue;
+    auto enqueue = [this, &queue](const SheetReference& ref)
+    {
+        if (auto it = dependents.find(ref); it != dependents.end())
+            queue.insert(queue.end(), it->second.begin(), it->second.end());
+    };
+
+    for (const Position& p : changed)
+    {
+        enqueue({sheet, p});
+    }
+
+    std::set<SheetReference> cleared;
+    while (!queue.empty())
+    {
+        SheetReference ref = std::move(queue.back());
+        queue.pop_back();
+
+        if (cleared.find(ref) != cleared.end())
+            continue;
+
+        // only cells of existing sheets ever reference anything
+        Sheet& target = *sheets.find(ref.sheet)->second;
+
+        std::set<Position> affected = target.graph.GetAllDependenciesFrom(ref.pos);
+        affected.insert(ref.pos);
+
+        for (const Position& p : affected)
+        {
+            if (!cleared.insert({ref.sheet, p}).second)
+                continue;
+
+            target.ClearCash(p);
+            enqueue({ref.sheet, p});
+        }
+    }
+    SPREADSHEET_METRIC_ADD(CellsInvalidated, cleared.size());
+}
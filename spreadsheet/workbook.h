@@ -0,0 +1,80 @@
+#pragma once
+
+#include "common.h"
+#include "sheet.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class InvalidSheetNameException : public std::invalid_argument
+{
+public:
+    using std::invalid_argument::invalid_argument;
+};
+
+// Every sheet of a workbook as of one Workbook::Publish() call; formulas of
+// one snapshot sheet read the other sheets of the same snapshot.
+class WorkbookSnapshot
+{
+public:
+    const SheetSnapshot* GetSheet(std::string_view name) const;
+    CellInterface::Value GetCellValue(const SheetReference& ref) const;
+
+private:
+    friend class Workbook;
+
+    std::map<std::string, SheetSnapshot, std::less<>> sheets;
+};
+
+// Named sheets whose formulas may read each other's cells as Sheet2!A1. Each
+// sheet keeps its own storage and dependency graph, so it is a shard of its
+// own: the workbook stores only the edges that cross sheets, an edit clears
+// the cashes of the downstream sheets alone, and Recalculate() evaluates the
+// sheets in parallel.
+class Workbook
+{
+public:
+    // Names follow the formula syntax: a letter or '_', then letters, digits or '_'
+    Sheet& AddSheet(std::string name);
+
+    Sheet* GetSheet(std::string_view name);
+    const Sheet* GetSheet(std::string_view name) const;
+    std::vector<std::string> GetSheetNames() const;
+
+    CellInterface::Value GetCellValue(const SheetReference& ref) const;
+
+    // One thread per sheet; cells of other sheets are evaluated by whichever
+    // thread reaches them first
+    void Recalculate() const;
+
+    // Publishes every sheet at once, so that no reader sees one sheet ahead of another
+    std::shared_ptr<const WorkbookSnapshot> Publish();
+    std::shared_ptr<const WorkbookSnapshot> GetSnapshot() const;
+
+private:
+    friend class Sheet;
+
+    // Throws CircularDependencyException if the cell `to` may not reference
+    // these cells of its own sheet and of the others. `dependents_in_sheet`
+    // holds the cells of its own sheet that depend on `to`: when `to` reads
+    // no other sheet and no other sheet reads `to` or any of them, no cycle
+    // can leave the sheet.
+    void CheckCycles(const SheetReference& to, const std::vector<Position>& cells, const std::vector<SheetReference>& sheet_cells, const std::set<Position>& dependents_in_sheet) const;
+    void SetSheetReferences(const SheetReference& to, std::vector<SheetReference> from);
+    // Clears the cashes of the cells of every sheet that depend on the changed cells of this one
+    void InvalidateDependents(const std::string& sheet, const std::set<Position>& changed);
+
+    std::map<std::string, std::unique_ptr<Sheet>, std::less<>> sheets;
+
+    // edges between cells of different sheets only, in both directions
+    std::map<SheetReference, std::vector<SheetReference>> references;
+    std::map<SheetReference, std::set<SheetReference>> dependents;
+
+    std::shared_ptr<const WorkbookSnapshot> published;
+};
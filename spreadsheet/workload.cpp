@@ -0,0 +1,344 @@
+#include "workload.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <random>
+
+namespace
+{
+    // References within this many rows count as local
+    const int LOCAL_ROWS = 4;
+
+    // The standard distributions are free to differ between libraries, so
+    // the engine output is mapped by hand to keep workloads reproducible
+    class Random
+    {
+    public:
+        explicit Random(std::uint64_t seed) : engine(seed) {}
+
+        // in [0, n)
+        std::size_t Below(std::size_t n)
+        {
+            return engine() % n;
+        }
+        bool Chance(double p)
+        {
+            return double(engine() >> 11) * 0x1.0p-53 < p;
+        }
+
+    private:
+        std::mt19937_64 engine;
+    };
+
+    enum class Kind
+    {
+        Number,
+        Text,
+        Formula,
+    };
+
+    struct Generated
+    {
+        Position pos;
+        Kind kind;
+        int depth = 0;  // the longest path of references from the cell
+        int readers = 0;
+    };
+
+    class Generator
+    {
+    public:
+        explicit Generator(const WorkloadConfig& config) : config(config), random(config.seed) {}
+
+        Workload Run()
+        {
+            Workload workload;
+            workload.size = config.size;
+
+            for (int row = 0; row < config.size.rows; ++row)
+            {
+                for (int col = 0; col < config.size.cols; ++col)
+                {
+                    workload.setup.push_back({WorkloadCommand::Type::Set, {row, col}, Generate({row, col})});
+                }
+            }
+
+            AddEdits(workload);
+            return workload;
+        }
+
+    private:
+        std::string Generate(Position pos)
+        {
+            Generated cell{pos, Kind::Formula};
+            std::string text;
+
+            if (random.Chance(config.number_ratio))
+            {
+                cell.kind = Kind::Number;
+                text = NewNumber();
+            }
+            else if (random.Chance(config.text_ratio / (1 - config.number_ratio)))
+            {
+                cell.kind = Kind::Text;
+                text = "item" + std::to_string(random.Below(1000));
+            }
+            else
+                text = NewFormula(cell);
+
+            index_of[pos.row * config.size.cols + pos.col] = cells.size();
+            if (cell.kind == Kind::Number)
+                numbers.push_back(cells.size());
+            if (cell.kind == Kind::Text)
+                texts.push_back(cells.size());
+            else
+                readable.push_back(cells.size());
+            cells.push_back(cell);
+
+            return text;
+        }
+
+        std::string NewNumber()
+        {
+            return std::to_string(random.Below(1000));
+        }
+
+        std::string NewFormula(Generated& cell)
+        {
+            std::vector<std::size_t> refs;
+
+            // continue the chain of the cell above
+            if (cell.pos.row > 0)
+            {
+                std::size_t above = index_of[(cell.pos.row - 1) * config.size.cols + cell.pos.col];
+                if (cells[above].kind == Kind::Formula)
+                    Read(refs, above);
+            }
+            // a few tries at distinct references; the first cells have few to choose from
+            for (int tries = 0; int(refs.size()) < config.fan_in && tries < 4 * config.fan_in && !readable.empty(); ++tries)
+            {
+                Read(refs, PickReference(cell.pos));
+            }
+
+            std::string text = "=";
+            if (refs.empty())
+                text += NewNumber();
+            else if (refs.size() == 1)
+                text += cells[refs[0]].pos.ToString() + "+1";
+            else
+            {
+                // averaging keeps the values in range however deep the chains go
+                text += '(';
+                for (std::size_t i = 0; i < refs.size(); ++i)
+                {
+                    if (i)
+                        text += random.Chance(0.5) ? '+' : '-';
+                    text += cells[refs[i]].pos.ToString();
+                }
+                text += ")/" + std::to_string(refs.size());
+            }
+
+            for (std::size_t ref : refs)
+            {
+                cell.depth = std::max(cell.depth, cells[ref].depth + 1);
+                ++cells[ref].readers;
+            }
+
+            bool in_error_region = config.error_region_rows == 0 || cell.pos.row >= config.size.rows - config.error_region_rows;
+            if (in_error_region && random.Chance(config.error_ratio))
+            {
+                if (!texts.empty() && random.Chance(0.5))
+                {
+                    std::size_t text_cell = texts[random.Below(texts.size())];
+                    ++cells[text_cell].readers;
+                    text += "+" + cells[text_cell].pos.ToString();
+                }
+                else
+                    text += "/0";
+            }
+
+            return text;
+        }
+
+        std::size_t PickReference(Position pos)
+        {
+            if (config.hubs > 0 && !numbers.empty() && random.Chance(config.hub_ratio))
+                return numbers[random.Below(std::min<std::size_t>(numbers.size(), config.hubs))];
+
+            // the readable cells of the last few rows, unless there are none
+            auto first = std::lower_bound(readable.begin(), readable.end(), pos.row - LOCAL_ROWS, [this](std::size_t index, int row)
+            {
+                return cells[index].pos.row < row;
+            });
+            if (first == readable.end() || random.Chance(config.density))
+                first = readable.begin();
+
+            return *(first + random.Below(readable.end() - first));
+        }
+
+        // Adds the reference unless it would make the chains too deep, in
+        // which case a number is read instead, if there is one; a cell
+        // already read is not added again
+        void Read(std::vector<std::size_t>& refs, std::size_t index)
+        {
+            if (cells[index].depth + 1 > config.chain_depth)
+            {
+                if (numbers.empty())
+                    return;
+                index = numbers[random.Below(numbers.size())];
+            }
+            if (std::find(refs.begin(), refs.end(), index) == refs.end())
+                refs.push_back(index);
+        }
+
+        void AddEdits(Workload& workload)
+        {
+            std::vector<std::size_t> targets;
+            for (std::size_t i = 0; i < cells.size(); ++i)
+            {
+                bool is_target = false;
+                switch (config.edit_pattern)
+                {
+                case EditPattern::Root:
+                    is_target = cells[i].kind == Kind::Number && cells[i].readers > 0;
+                    break;
+                case EditPattern::Leaf:
+                    is_target = cells[i].readers == 0;
+                    break;
+                case EditPattern::Random:
+                    is_target = true;
+                    break;
+                }
+
+                if (is_target)
+                    targets.push_back(i);
+            }
+
+            if (targets.empty())
+                return;
+
+            for (int i = 0; i < config.edits; ++i)
+            {
+                const Generated& cell = cells[targets[random.Below(targets.size())]];
+                const std::string& text = workload.setup[cell.pos.row * config.size.cols + cell.pos.col].text;
+
+                // a formula keeps its references, so an edit never makes a cycle
+                if (cell.kind == Kind::Formula)
+                    workload.edits.push_back({WorkloadCommand::Type::Set, cell.pos, "=" + NewNumber() + "+(" + text.substr(1) + ")"});
+                else
+                    workload.edits.push_back({WorkloadCommand::Type::Set, cell.pos, NewNumber()});
+
+                if (config.recalculate_every > 0 && (i + 1) % config.recalculate_every == 0)
+                    workload.edits.push_back({WorkloadCommand::Type::Recalculate, Position::NONE, ""});
+            }
+        }
+
+        const WorkloadConfig& config;
+        Random random;
+
+        std::vector<Generated> cells;  // in generation order
+        std::vector<std::size_t> index_of = std::vector<std::size_t>(std::size_t(config.size.rows) * config.size.cols);
+        std::vector<std::size_t> numbers;
+        std::vector<std::size_t> texts;
+        std::vector<std::size_t> readable;  // numbers and formulas
+    };
+}
+
+bool WorkloadCommand::operator==(const WorkloadCommand& rhs) const
+{
+    return type == rhs.type && pos == rhs.pos && text == rhs.text;
+}
+
+Workload GenerateWorkload(const WorkloadConfig& config)
+{
+    if (config.size.rows < 0 || config.size.cols < 0 || config.size.rows > Position::GetMaxRows() || config.size.cols > Position::GetMaxCols())
+        throw InvalidPositionException("Workload does not fit in a sheet");
+
+    return Generator(config).Run();
+}
+
+void WriteScript(std::ostream& output, const std::vector<WorkloadCommand>& commands)
+{
+    for (const WorkloadCommand& command : commands)
+    {
+        switch (command.type)
+        {
+        case WorkloadCommand::Type::Set:
+            output << "set\t" << command.pos.ToString() << '\t' << command.text << '\n';
+            break;
+        case WorkloadCommand::Type::Recalculate:
+            output << "recalculate\n";
+            break;
+        }
+    }
+}
+
+std::vector<WorkloadCommand> ReadScript(std::istream& input)
+{
+    std::vector<WorkloadCommand> result;
+
+    std::string line;
+    while (std::getline(input, line))
+    {
+        if (line.empty())
+            continue;
+
+        if (line == "recalculate")
+        {
+            result.push_back({WorkloadCommand::Type::Recalculate, Position::NONE, ""});
+            continue;
+        }
+
+        std::size_t pos_end = line.find('\t', 4);
+        if (line.compare(0, 4, "set\t") != 0 || pos_end == std::string::npos)
+            throw InvalidScriptException("Invalid workload command: " + line);
+
+        Position pos = Position::FromString(std::string_view(line).substr(4, pos_end - 4));
+        if (!pos.IsValid())
+            throw InvalidScriptException("Invalid position in workload command: " + line);
+
+        result.push_back({WorkloadCommand::Type::Set, pos, line.substr(pos_end + 1)});
+    }
+
+    return result;
+}
+
+void WriteTsv(std::ostream& output, const Workload& workload)
+{
+    std::vector<std::string> texts(std::size_t(workload.size.rows) * workload.size.cols);
+    for (const WorkloadCommand& command : workload.setup)
+    {
+        if (command.type == WorkloadCommand::Type::Set)
+            texts[command.pos.row * workload.size.cols + command.pos.col] = command.text;
+    }
+
+    for (int row = 0; row < workload.size.rows; ++row)
+    {
+        for (int col = 0; col < workload.size.cols; ++col)
+        {
+            if (col)
+                output << '\t';
+            output << texts[row * workload.size.cols + col];
+        }
+        output << '\n';
+    }
+}
+
+void Replay(Sheet& sheet, const std::vector<WorkloadCommand>& commands)
+{
+    for (const WorkloadCommand& command : commands)
+    {
+        switch (command.type)
+        {
+        case WorkloadCommand::Type::Set:
+            sheet.SetCell(command.pos, command.text);
+            break;
+        case WorkloadCommand::Type::Recalculate:
+            sheet.Recalculate();
+            break;
+        }
+    }
+}
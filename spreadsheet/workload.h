@@ -0,0 +1,81 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class Sheet;
+
+class InvalidScriptException : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+enum class EditPattern
+{
+    Root,    // numbers that formulas read
+    Leaf,    // cells nothing reads
+    Random,  // any generated cell
+};
+
+// Shape of a synthetic sheet and of the edits made to it. The same config,
+// seed included, always gives the same workload, on any platform.
+struct WorkloadConfig
+{
+    std::uint64_t seed = 1;
+    Size size{1000, 10};  // cells are generated row by row, every one of them set
+
+    double number_ratio = 0.4;
+    double text_ratio = 0.1;  // the rest are formulas
+
+    int chain_depth = 16;    // the longest path of references; a formula continues the one above it
+    int fan_in = 2;          // references per formula
+    int hubs = 4;            // numbers (the first ones generated) that many formulas read
+    double hub_ratio = 0.1;  // share of references that go to a hub
+    double density = 0.2;    // share of references to any earlier cell; the rest stay within a few rows
+
+    double error_ratio = 0.0;   // share of formulas that fail with #DIV/0! or #VALUE! (their readers fail too)
+    int error_region_rows = 0;  // failing formulas only in that many last rows; 0 for anywhere
+
+    EditPattern edit_pattern = EditPattern::Random;
+    int edits = 100;
+    int recalculate_every = 1;  // edits between recalculations; 0 for none
+};
+
+struct WorkloadCommand
+{
+    enum class Type
+    {
+        Set,
+        Recalculate,
+    };
+
+    Type type;
+    Position pos = Position::NONE;
+    std::string text;
+
+    bool operator==(const WorkloadCommand& rhs) const;
+};
+
+struct Workload
+{
+    Size size;
+    std::vector<WorkloadCommand> setup;  // fills the sheet
+    std::vector<WorkloadCommand> edits;  // then changes it; formulas keep their references
+};
+
+// Formulas only read cells generated before them, so the sheet never has a cycle
+Workload GenerateWorkload(const WorkloadConfig& config);
+
+// One command per line: "set<TAB>A1<TAB>text" or "recalculate"
+void WriteScript(std::ostream& output, const std::vector<WorkloadCommand>& commands);
+std::vector<WorkloadCommand> ReadScript(std::istream& input);
+// The texts of the sheet the setup builds, laid out as Sheet::PrintTexts would
+void WriteTsv(std::ostream& output, const Workload& workload);
+
+void Replay(Sheet& sheet, const std::vector<WorkloadCommand>& commands);
@@ -0,0 +1,160 @@
+// Generates a synthetic workload (see workload.h) from a seed.
+// Usage: spreadsheet_workload [--option=value ...]
+//   --format=script  setup and edits as a command script (the default)
+//   --format=tsv     the texts of the sheet the setup builds
+//   --format=run     replays the workload on a Sheet and prints a JSON summary
+// Every WorkloadConfig field has an option; run with --help for the list.
+
+#include "sheet.h"
+#include "workload.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+    using Setter = std::function<void(WorkloadConfig&, const std::string&)>;
+
+    int ToInt(const std::string& value)
+    {
+        return std::stoi(value);
+    }
+    double ToDouble(const std::string& value)
+    {
+        return std::stod(value);
+    }
+    EditPattern ToEditPattern(const std::string& value)
+    {
+        if (value == "root")
+            return EditPattern::Root;
+        if (value == "leaf")
+            return EditPattern::Leaf;
+        if (value == "random")
+            return EditPattern::Random;
+
+        throw std::invalid_argument(value);
+    }
+
+    const std::map<std::string, Setter>& GetOptions()
+    {
+        static const std::map<std::string, Setter> options =
+        {
+            {"seed", [](WorkloadConfig& c, const std::string& v) { c.seed = std::stoull(v); }},
+            {"rows", [](WorkloadConfig& c, const std::string& v) { c.size.rows = ToInt(v); }},
+            {"cols", [](WorkloadConfig& c, const std::string& v) { c.size.cols = ToInt(v); }},
+            {"number-ratio", [](WorkloadConfig& c, const std::string& v) { c.number_ratio = ToDouble(v); }},
+            {"text-ratio", [](WorkloadConfig& c, const std::string& v) { c.text_ratio = ToDouble(v); }},
+            {"chain-depth", [](WorkloadConfig& c, const std::string& v) { c.chain_depth = ToInt(v); }},
+            {"fan-in", [](WorkloadConfig& c, const std::string& v) { c.fan_in = ToInt(v); }},
+            {"hubs", [](WorkloadConfig& c, const std::string& v) { c.hubs = ToInt(v); }},
+            {"hub-ratio", [](WorkloadConfig& c, const std::string& v) { c.hub_ratio = ToDouble(v); }},
+            {"density", [](WorkloadConfig& c, const std::string& v) { c.density = ToDouble(v); }},
+            {"error-ratio", [](WorkloadConfig& c, const std::string& v) { c.error_ratio = ToDouble(v); }},
+            {"error-region-rows", [](WorkloadConfig& c, const std::string& v) { c.error_region_rows = ToInt(v); }},
+            {"edit-pattern", [](WorkloadConfig& c, const std::string& v) { c.edit_pattern = ToEditPattern(v); }},
+            {"edits", [](WorkloadConfig& c, const std::string& v) { c.edits = ToInt(v); }},
+            {"recalculate-every", [](WorkloadConfig& c, const std::string& v) { c.recalculate_every = ToInt(v); }},
+        };
+        return options;
+    }
+
+    void PrintUsage(std::ostream& output)
+    {
+        output << "usage: spreadsheet_workload [--format=script|tsv|run]";
+        for (const auto& [name, setter] : GetOptions())
+        {
+            output << " [--" << name << "=...]";
+        }
+        output << '\n';
+    }
+
+    double MillisecondsSince(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void Run(const Workload& workload, std::ostream& output)
+    {
+        Sheet sheet;
+
+        auto start = std::chrono::steady_clock::now();
+        Replay(sheet, workload.setup);
+        sheet.Recalculate();
+        double setup_ms = MillisecondsSince(start);
+
+        start = std::chrono::steady_clock::now();
+        Replay(sheet, workload.edits);
+        double edits_ms = MillisecondsSince(start);
+
+        output << "{\"cells\": " << workload.setup.size() << ", \"edits\": " << workload.edits.size()
+               << ", \"setup_ms\": " << setup_ms << ", \"edits_ms\": " << edits_ms
+               << ", \"memory_bytes\": " << sheet.GetMemoryReport().GetTotal() << "}\n";
+    }
+}
+
+int main(int argc, char** argv)
+{
+    WorkloadConfig config;
+    std::string format = "script";
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        std::size_t equals = arg.find('=');
+        std::string name = arg.substr(0, equals);
+        std::string value = equals == std::string::npos ? "" : arg.substr(equals + 1);
+
+        if (name == "--help")
+        {
+            PrintUsage(std::cout);
+            return 0;
+        }
+        if (name == "--format" && (value == "script" || value == "tsv" || value == "run"))
+        {
+            format = value;
+            continue;
+        }
+
+        auto option = name.rfind("--", 0) == 0 ? GetOptions().find(name.substr(2)) : GetOptions().end();
+        try
+        {
+            if (option == GetOptions().end() || equals == std::string::npos)
+                throw std::invalid_argument(arg);
+            option->second(config, value);
+        }
+        catch (const std::exception&)
+        {
+            std::cerr << "invalid option: " << arg << '\n';
+            PrintUsage(std::cerr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    Workload workload;
+    try
+    {
+        workload = GenerateWorkload(config);
+    }
+    catch (const std::exception& exc)
+    {
+        std::cerr << exc.what() << '\n';
+        return EXIT_FAILURE;
+    }
+
+    if (format == "tsv")
+        WriteTsv(std::cout, workload);
+    else if (format == "run")
+        Run(workload, std::cout);
+    else
+    {
+        WriteScript(std::cout, workload.setup);
+        WriteScript(std::cout, workload.edits);
+    }
+
+    return 0;
+}